@@ -0,0 +1,603 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Fabio Vaccari
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// benchmark of the cache over an in-memory backend
+// run with --help for the parameters
+
+#include "db_cache.h"
+#include "memory_backend.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::chrono::steady_clock;
+
+namespace {
+
+struct bench_options
+{
+    unsigned threads;
+    size_t keys; // key space
+    bool zipf; // otherwise uniform
+    double theta; // zipf skew, 0 < theta < 1
+    unsigned reads; // percent of the operations
+    size_t value_min, value_max; // value sizes, in bytes
+    bool lognormal; // value sizes, otherwise uniform
+    double sigma; // lognormal shape, larger for a longer tail
+    double seconds; // run time, if ops is 0
+    size_t ops; // per thread
+    unsigned seed;
+    bool json;
+    
+    db_cache_options cache;
+    memory_backend_options backend;
+    
+    bench_options() :
+        threads(std::max(std::thread::hardware_concurrency(), 1u)),
+        keys(100000), zipf(true), theta(0.99), reads(90), value_min(16),
+        value_max(256), lognormal(false), sigma(1), seconds(5), ops(0),
+        seed(1), json(false)
+    {
+        cache.max_size = 50000;
+        cache.update_time = 100;
+        backend.fetch_latency = std::chrono::microseconds(200);
+        backend.store_latency = std::chrono::microseconds(500);
+    }
+};
+
+const char *usage =
+    "usage: bench [--name=value ...]\n"
+    "  --threads=N         request threads\n"
+    "  --keys=N            key space\n"
+    "  --dist=zipf|uniform key distribution\n"
+    "  --theta=X           zipf skew, between 0 and 1 excluded\n"
+    "  --reads=P           percent of reads, the rest are writes\n"
+    "  --value-min=N       smallest value, bytes\n"
+    "  --value-max=N       largest value, bytes\n"
+    "  --sizes=uniform|lognormal value size distribution\n"
+    "  --sigma=X           lognormal shape, larger for a longer tail\n"
+    "  --seconds=X         run time\n"
+    "  --ops=N             operations per thread, instead of run time\n"
+    "  --seed=N            random seed\n"
+    "  --cache-size=N      db_cache_options::max_size\n"
+    "  --cache-bytes=N     db_cache_options::max_bytes\n"
+    "  --shards=N          db_cache_options::shards\n"
+    "  --policy=clock|slru|tinylfu\n"
+    "  --update-ms=N       db_cache_options::update_time\n"
+    "  --timeout-ms=N      db_cache_options::timeout\n"
+    "  --writers=N         db_cache_options::writers\n"
+    "  --cold-cycles=N     db_cache_options::cold_cycles\n"
+    "  --l1-size=N         db_cache_options::l1_size, reads use get_value()\n"
+    "  --wal=PATH          db_cache_options::wal\n"
+    "  --fetch-us=N        backend latency of a fetch\n"
+    "  --store-us=N        backend latency of a store\n"
+    "  --json              print the results as JSON\n";
+
+template <typename T>
+T parse(const std::string &name, const std::string &value)
+{
+    std::istringstream in(value);
+    T t;
+    
+    if ( ! (in >> t) || ! in.eof()) {
+        throw std::invalid_argument("bad value for --" + name);
+    }
+    return t;
+}
+
+bench_options parse_args(int argc, char *argv[])
+{
+    bench_options o;
+    
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        
+        if (arg.compare(0, 2, "--") != 0) {
+            throw std::invalid_argument("unexpected " + arg);
+        }
+        
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(2, eq - 2);
+        std::string value = eq != std::string::npos ? arg.substr(eq + 1) : "";
+        
+        if (name == "help") {
+            std::cout << usage;
+            std::exit(0);
+        } else if (name == "json") {
+            o.json = true;
+        } else if (name == "threads") {
+            o.threads = std::max(parse<unsigned>(name, value), 1u);
+        } else if (name == "keys") {
+            o.keys = std::max(parse<size_t>(name, value), size_t(1));
+        } else if (name == "dist") {
+            if (value != "zipf" && value != "uniform") {
+                throw std::invalid_argument("bad value for --dist");
+            }
+            o.zipf = value == "zipf";
+        } else if (name == "theta") {
+            o.theta = parse<double>(name, value);
+            if ( ! (o.theta > 0 && o.theta < 1)) {
+                throw std::invalid_argument("--theta is not in (0, 1)");
+            }
+        } else if (name == "reads") {
+            o.reads = std::min(parse<unsigned>(name, value), 100u);
+        } else if (name == "value-min") {
+            o.value_min = parse<size_t>(name, value);
+        } else if (name == "value-max") {
+            o.value_max = parse<size_t>(name, value);
+        } else if (name == "sizes") {
+            if (value != "uniform" && value != "lognormal") {
+                throw std::invalid_argument("bad value for --sizes");
+            }
+            o.lognormal = value == "lognormal";
+        } else if (name == "sigma") {
+            o.sigma = parse<double>(name, value);
+            if ( ! (o.sigma > 0)) {
+                throw std::invalid_argument("--sigma is not positive");
+            }
+        } else if (name == "seconds") {
+            o.seconds = parse<double>(name, value);
+        } else if (name == "ops") {
+            o.ops = parse<size_t>(name, value);
+        } else if (name == "seed") {
+            o.seed = parse<unsigned>(name, value);
+        } else if (name == "cache-size") {
+            o.cache.max_size = parse<size_t>(name, value);
+        } else if (name == "cache-bytes") {
+            o.cache.max_bytes = parse<size_t>(name, value);
+        } else if (name == "shards") {
+            o.cache.shards = parse<unsigned>(name, value);
+        } else if (name == "policy") {
+            if (value == "clock") o.cache.policy = eviction::clock;
+            else if (value == "slru") o.cache.policy = eviction::slru;
+            else if (value == "tinylfu") o.cache.policy = eviction::tinylfu;
+            else throw std::invalid_argument("bad value for --policy");
+        } else if (name == "update-ms") {
+            o.cache.update_time = parse<unsigned>(name, value);
+        } else if (name == "timeout-ms") {
+            o.cache.timeout = parse<int>(name, value);
+        } else if (name == "writers") {
+            o.cache.writers = parse<unsigned>(name, value);
+        } else if (name == "cold-cycles") {
+            o.cache.cold_cycles = parse<unsigned>(name, value);
+        } else if (name == "l1-size") {
+            o.cache.l1_size = parse<size_t>(name, value);
+        } else if (name == "wal") {
+            o.cache.wal = value;
+        } else if (name == "fetch-us") {
+            o.backend.fetch_latency =
+                std::chrono::microseconds(parse<unsigned>(name, value));
+        } else if (name == "store-us") {
+            o.backend.store_latency =
+                std::chrono::microseconds(parse<unsigned>(name, value));
+        } else {
+            throw std::invalid_argument("unknown option --" + name);
+        }
+    }
+    
+    o.value_max = std::max(o.value_max, o.value_min);
+    return o;
+}
+
+// ranks 0 .. n - 1, rank 0 the most frequent (Gray et al., "Quickly
+// generating billion-record synthetic databases", as in YCSB)
+class zipf_distribution
+{
+    const size_t z_n;
+    const double z_theta, z_alpha, z_zetan, z_eta, z_half;
+    
+    static double zeta(size_t n, double theta)
+    {
+        double sum = 0;
+        for (size_t i = 1; i <= n; ++i) sum += 1 / std::pow(double(i), theta);
+        return sum;
+    }
+    
+public:
+    zipf_distribution(size_t n, double theta) :
+        z_n(n), z_theta(theta), z_alpha(1 / (1 - theta)),
+        z_zetan(zeta(n, theta)),
+        z_eta((1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta)
+            / z_zetan)),
+        z_half(1 + std::pow(0.5, theta))
+    {}
+    
+    template <typename G>
+    size_t operator () (G &g) const
+    {
+        double u = std::uniform_real_distribution<double>()(g);
+        double uz = u * z_zetan;
+        
+        if (uz < 1) return 0;
+        if (uz < z_half) return std::min<size_t>(1, z_n - 1);
+        return std::min(z_n - 1,
+            size_t(z_n * std::pow(z_eta * u - z_eta + 1, z_alpha)));
+    }
+};
+
+// value sizes in [min, max]: uniform, or lognormal with the median at
+// the geometric mean of the bounds, so most values are small and a few
+// are large; a size out of the bounds is drawn again
+class size_distribution
+{
+    std::uniform_int_distribution<size_t> sd_uniform;
+    std::lognormal_distribution<double> sd_lognormal;
+    const bool sd_skewed;
+    const double sd_min, sd_max;
+    
+public:
+    explicit size_distribution(const bench_options &o) :
+        sd_uniform(o.value_min, o.value_max),
+        sd_lognormal(0.5 * std::log(std::max(o.value_min, size_t(1))
+            * double(o.value_max)), o.sigma),
+        sd_skewed(o.lognormal), sd_min(o.value_min), sd_max(o.value_max)
+    {}
+    
+    template <typename G>
+    size_t operator () (G &g)
+    {
+        if ( ! sd_skewed || sd_min == sd_max) return sd_uniform(g);
+        
+        for (;;) {
+            double size = std::round(sd_lognormal(g));
+            if (size >= sd_min && size <= sd_max) return size_t(size);
+        }
+    }
+};
+
+// operation latencies: 32 buckets for each power of two of nanoseconds,
+// so a percentile is within 3% of the recorded value
+class latency_recorder
+{
+    static const unsigned sub = 5; // 2^sub buckets
+    std::vector<uint64_t> lr_count;
+    uint64_t lr_total;
+    uint64_t lr_max;
+    
+    static size_t index(uint64_t ns)
+    {
+        unsigned bits = ns != 0 ? 64 - __builtin_clzll(ns) : 0;
+        unsigned shift = bits > sub + 1 ? bits - sub - 1 : 0;
+        return (size_t(shift) << sub) + (ns >> shift);
+    }
+    
+    // the middle of a bucket
+    static uint64_t value(size_t i)
+    {
+        unsigned shift = i < (2u << sub) ? 0 : unsigned(i >> sub) - 1;
+        uint64_t base = i - (size_t(shift) << sub);
+        return (base << shift) + ((uint64_t(1) << shift) >> 1);
+    }
+    
+public:
+    latency_recorder() : lr_count(index(UINT64_MAX) + 1), lr_total(0),
+        lr_max(0)
+    {}
+    
+    void add(steady_clock::duration d)
+    {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            d).count();
+        ++lr_count[index(ns)];
+        lr_total += ns;
+        lr_max = std::max(lr_max, ns);
+    }
+    
+    void merge(const latency_recorder &r)
+    {
+        for (size_t i = 0; i < lr_count.size(); ++i) {
+            lr_count[i] += r.lr_count[i];
+        }
+        lr_total += r.lr_total;
+        lr_max = std::max(lr_max, r.lr_max);
+    }
+    
+    uint64_t count() const
+    {
+        uint64_t n = 0;
+        for (uint64_t c : lr_count) n += c;
+        return n;
+    }
+    
+    double mean() const
+    {
+        uint64_t n = count();
+        return n != 0 ? double(lr_total) / n : 0;
+    }
+    
+    uint64_t max() const { return lr_max; }
+    
+    uint64_t percentile(double p) const
+    {
+        uint64_t n = count();
+        if (n == 0) return 0;
+        
+        uint64_t rank = uint64_t(std::ceil(p / 100 * n)), seen = 0;
+        
+        for (size_t i = 0; i < lr_count.size(); ++i) {
+            seen += lr_count[i];
+            if (seen >= std::max<uint64_t>(rank, 1)) {
+                return std::min(value(i), lr_max);
+            }
+        }
+        return lr_max;
+    }
+};
+
+struct thread_result
+{
+    latency_recorder t_reads;
+    latency_recorder t_writes;
+    uint64_t t_timeouts;
+    uint64_t t_read_bytes; // keeps the reads
+    
+    thread_result() : t_timeouts(0), t_read_bytes(0) {}
+};
+
+std::string make_key(size_t id)
+{
+    char key[24];
+    std::snprintf(key, sizeof(key), "k%010zu", id);
+    return key;
+}
+
+void fill(memory_backend &backend, const bench_options &o,
+    const std::string &values)
+{
+    std::mt19937_64 g(o.seed);
+    size_distribution size(o);
+    std::vector<db_backend::record> list;
+    
+    for (size_t id = 0; id < o.keys; ++id) {
+        list.emplace_back(make_key(id), values.substr(0, size(g)));
+        
+        if (list.size() == 10000 || id + 1 == o.keys) {
+            backend.store(list);
+            list.clear();
+        }
+    }
+}
+
+void run(db_cache &cache, memory_backend &backend, const bench_options &o,
+    const std::vector<size_t> &ids, const zipf_distribution &zipf,
+    const std::string &values, unsigned n, thread_result &r,
+    std::atomic<bool> &stop)
+{
+    std::mt19937_64 g(o.seed * 7919 + n + 1);
+    std::uniform_int_distribution<size_t> uniform(0, o.keys - 1);
+    std::uniform_int_distribution<unsigned> percent(0, 99);
+    size_distribution size(o);
+    
+    backend.thread_init();
+    
+    for (size_t i = 0; o.ops != 0 ? i < o.ops : ! stop; ++i) {
+        const std::string key = make_key(ids[o.zipf ? zipf(g) : uniform(g)]);
+        bool read = percent(g) < o.reads;
+        std::string value;
+        if ( ! read) value = values.substr(0, size(g));
+        
+        auto t0 = steady_clock::now();
+        
+        try {
+            if (read && o.cache.l1_size != 0) {
+                r.t_read_bytes += cache.get_value(key) -> size();
+            } else if (read) {
+                read_handle h = cache.get_shared(key);
+                r.t_read_bytes += h.value().size();
+            } else {
+                data_handle h = cache[key];
+                h.modify() = std::move(value);
+            }
+        } catch (db_cache_timeout&) {
+            ++r.t_timeouts;
+        }
+        
+        (read ? r.t_reads : r.t_writes).add(steady_clock::now() - t0);
+    }
+    
+    backend.thread_end();
+}
+
+void print_text(const bench_options &o, double seconds,
+    const latency_recorder &all, const thread_result &total,
+    const db_cache_stats &st, const memory_backend &backend)
+{
+    auto us = [] (double ns) { return ns / 1000; };
+    
+    std::printf("threads %u, keys %zu, %s", o.threads, o.keys,
+        o.zipf ? "zipf" : "uniform");
+    if (o.zipf) std::printf(" %.2f", o.theta);
+    std::printf(", reads %u%%, values %zu-%zu bytes", o.reads,
+        o.value_min, o.value_max);
+    if (o.lognormal) std::printf(" lognormal %.2f", o.sigma);
+    std::printf("\n");
+    std::printf("ops %llu in %.2f s, %.0f ops/s, timeouts %llu\n",
+        (unsigned long long) all.count(), seconds, all.count() / seconds,
+        (unsigned long long) total.t_timeouts);
+    
+    const char *names[] = { "all", "reads", "writes" };
+    const latency_recorder *recs[] = {
+        &all, &total.t_reads, &total.t_writes
+    };
+    
+    std::printf("%-8s %10s %10s %10s %10s %10s (us)\n", "latency", "mean",
+        "p50", "p99", "p999", "max");
+    for (int i = 0; i < 3; ++i) {
+        const latency_recorder &r = *recs[i];
+        std::printf("%-8s %10.1f %10.1f %10.1f %10.1f %10.1f\n", names[i],
+            us(r.mean()), us(r.percentile(50)), us(r.percentile(99)),
+            us(r.percentile(99.9)), us(r.max()));
+    }
+    
+    uint64_t requests = st.hits + st.misses;
+    std::printf("cache hits %llu, misses %llu (hit ratio %.3f), "
+        "evictions %llu\n", (unsigned long long) st.hits,
+        (unsigned long long) st.misses,
+        requests != 0 ? double(st.hits) / requests : 0,
+        (unsigned long long) st.evictions);
+    std::printf("cache bytes %zu, cold entries %zu, cold bytes %zu, "
+        "cold hits %llu\n", st.bytes, st.cold_entries, st.cold_bytes,
+        (unsigned long long) st.cold_hits);
+    std::printf("l1 hits %llu\n", (unsigned long long) st.l1_hits);
+    std::printf("wal records %llu, commits %llu (mean %.1f us), "
+        "failures %llu\n", (unsigned long long) st.wal.records,
+        (unsigned long long) st.wal.commits,
+        st.wal.commit_time.mean_ns() / 1000,
+        (unsigned long long) st.wal.failures);
+    std::printf("backend fetches %llu, stores %llu\n",
+        (unsigned long long) backend.fetch_calls(),
+        (unsigned long long) backend.store_calls());
+}
+
+void print_json(const bench_options &o, double seconds,
+    const latency_recorder &all, const thread_result &total,
+    const db_cache_stats &st, const memory_backend &backend)
+{
+    auto latency = [] (const latency_recorder &r) {
+        std::ostringstream out;
+        out << "{\"count\": " << r.count()
+            << ", \"mean_ns\": " << uint64_t(r.mean())
+            << ", \"p50_ns\": " << r.percentile(50)
+            << ", \"p99_ns\": " << r.percentile(99)
+            << ", \"p999_ns\": " << r.percentile(99.9)
+            << ", \"max_ns\": " << r.max() << "}";
+        return out.str();
+    };
+    
+    std::cout
+        << "{\n"
+        << "  \"threads\": " << o.threads << ",\n"
+        << "  \"keys\": " << o.keys << ",\n"
+        << "  \"distribution\": \"" << (o.zipf ? "zipf" : "uniform")
+        << "\",\n"
+        << "  \"theta\": " << o.theta << ",\n"
+        << "  \"reads_percent\": " << o.reads << ",\n"
+        << "  \"value_min\": " << o.value_min << ",\n"
+        << "  \"value_max\": " << o.value_max << ",\n"
+        << "  \"value_sizes\": \"" << (o.lognormal ? "lognormal" : "uniform")
+        << "\",\n"
+        << "  \"sigma\": " << o.sigma << ",\n"
+        << "  \"seconds\": " << seconds << ",\n"
+        << "  \"ops\": " << all.count() << ",\n"
+        << "  \"ops_per_second\": " << uint64_t(all.count() / seconds)
+        << ",\n"
+        << "  \"timeouts\": " << total.t_timeouts << ",\n"
+        << "  \"latency\": " << latency(all) << ",\n"
+        << "  \"read_latency\": " << latency(total.t_reads) << ",\n"
+        << "  \"write_latency\": " << latency(total.t_writes) << ",\n"
+        << "  \"cache\": {\"hits\": " << st.hits
+        << ", \"misses\": " << st.misses
+        << ", \"lock_waits\": " << st.lock_waits
+        << ", \"evictions\": " << st.evictions
+        << ", \"flush_rows\": " << st.flush_rows
+        << ", \"bytes\": " << st.bytes
+        << ", \"cold_entries\": " << st.cold_entries
+        << ", \"cold_bytes\": " << st.cold_bytes
+        << ", \"cold_hits\": " << st.cold_hits
+        << ", \"l1_hits\": " << st.l1_hits
+        << ", \"wal_records\": " << st.wal.records
+        << ", \"wal_commits\": " << st.wal.commits
+        << ", \"wal_failures\": " << st.wal.failures << "},\n"
+        << "  \"backend\": {\"fetches\": " << backend.fetch_calls()
+        << ", \"stores\": " << backend.store_calls() << "}\n"
+        << "}" << std::endl;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options o;
+    
+    try {
+        o = parse_args(argc, argv);
+    } catch (std::exception &e) {
+        std::cerr << e.what() << '\n' << usage;
+        return 2;
+    }
+    
+    // hot ranks are spread over the key space
+    std::vector<size_t> ids(o.keys);
+    for (size_t i = 0; i < o.keys; ++i) ids[i] = i;
+    std::shuffle(ids.begin(), ids.end(), std::mt19937_64(o.seed));
+    
+    zipf_distribution zipf(o.keys, o.theta);
+    std::string values(o.value_max, 'v');
+    memory_backend backend(o.backend);
+    fill(backend, o, values);
+    
+    std::vector<thread_result> results(o.threads);
+    std::atomic<bool> stop(false);
+    db_cache_stats st;
+    double seconds;
+    
+    {
+        db_cache cache(&backend, o.cache);
+        std::vector<std::thread> vt;
+        auto t0 = steady_clock::now();
+        
+        for (unsigned n = 0; n < o.threads; ++n) {
+            vt.emplace_back([&, n] {
+                run(cache, backend, o, ids, zipf, values, n, results[n], stop);
+            });
+        }
+        
+        if (o.ops == 0) {
+            std::this_thread::sleep_for(
+                std::chrono::duration<double>(o.seconds));
+            stop = true;
+        }
+        for (auto &t : vt) t.join();
+        
+        seconds = std::chrono::duration<double>(
+            steady_clock::now() - t0).count();
+        st = cache.stats();
+    }
+    
+    thread_result total;
+    latency_recorder all;
+    
+    for (auto &r : results) {
+        total.t_reads.merge(r.t_reads);
+        total.t_writes.merge(r.t_writes);
+        total.t_timeouts += r.t_timeouts;
+    }
+    all.merge(total.t_reads);
+    all.merge(total.t_writes);
+    
+    if (o.json) print_json(o, seconds, all, total, st, backend);
+    else print_text(o, seconds, all, total, st, backend);
+    return 0;
+}
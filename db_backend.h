@@ -0,0 +1,84 @@
+#ifndef DB_BACKEND_H
+#define DB_BACKEND_H
+
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Fabio Vaccari
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+/*!
+    \brief The database behind a cache.
+    
+    A backend fetches and stores records of a key/data table, where a
+    missing key reads as empty data. Methods are called by many threads
+    at once; thread_init() and thread_end() bracket the work of a thread
+    which uses the backend, see mysql_client.
+*/
+class db_backend
+{
+public:
+    
+    // key, data
+    typedef std::tuple<std::string, std::string> record;
+    
+    // key, data shared with the cache, immutable while it is stored
+    typedef std::shared_ptr<const std::string> value_ptr;
+    typedef std::tuple<std::string, value_ptr> shared_record;
+    
+    virtual ~db_backend() {}
+    
+    virtual std::string fetch(const std::string &key) = 0;
+    
+    //! The records found, in any order.
+    virtual std::vector<record> fetch_many(
+        const std::vector<std::string> &keys) = 0;
+    
+    /*!
+        \brief Fetch a page of records in key order.
+        
+        \param from first key of the page.
+        \param to end of the range, not included; empty for no end.
+        \param limit most records in the page.
+        \param next from is the last key of the previous page, not included.
+        \return the records sorted by key.
+    */
+    virtual std::vector<record> fetch_range(const std::string &from,
+        const std::string &to, size_t limit, bool next = false) = 0;
+    
+    virtual void store(const std::string &key, const std::string &data) = 0;
+    
+    //! Store many records at once, all of them or none.
+    virtual void store(const std::vector<record> &list) = 0;
+    
+    //! The same, for data held by the cache without a copy.
+    virtual void store(const std::vector<shared_record> &list) = 0;
+    
+    virtual void thread_init() = 0;
+    virtual void thread_end() = 0;
+};
+
+#endif
@@ -23,138 +23,1598 @@ THE SOFTWARE.
 */
 
 #include "db_cache.h"
-#include "mysql_client.h"
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <unordered_map>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <zlib.h>
 
-handle* db_cache::locate(const std::string &key)
+namespace {
+
+// checks of the word before sleeping on it
+const unsigned spins = 64;
+
+// see db_cache::c_id
+std::atomic<uint64_t> cache_ids(0);
+
+inline void cpu_relax()
 {
-    std::unique_lock<std::mutex> lk(c_cache_guard);
-    c_read_lock.wait(lk, [this] {
-        return c_cache_write_req == 0;
-    });
-    ++c_cache_reading;
-    lk.unlock();
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// cold tier data, zlib format
+std::string compress_data(const std::string &data)
+{
+    uLongf size = ::compressBound(data.size());
+    std::string out(size, '\0');
     
-    handle* h = nullptr;
-    auto i = c_cache.find(key);
+    if (::compress2(reinterpret_cast<Bytef*>(&out[0]), &size,
+            reinterpret_cast<const Bytef*>(data.data()), data.size(),
+            Z_DEFAULT_COMPRESSION) != Z_OK) {
+        throw std::runtime_error("Cold tier: cannot compress the data.");
+    }
+    out.resize(size);
+    out.shrink_to_fit();
+    return out;
+}
+
+std::string expand_data(const std::string &data, size_t raw_size)
+{
+    uLongf size = raw_size;
+    std::string out(raw_size, '\0');
     
-    // found in the cache
-    if (i != c_cache.end()) {
-        h = i -> second;
-        h -> set_touched(true);
+    if (::uncompress(reinterpret_cast<Bytef*>(&out[0]), &size,
+            reinterpret_cast<const Bytef*>(data.data()), data.size()) != Z_OK
+            || size != raw_size) {
+        throw std::runtime_error("Cold tier: corrupted data.");
+    }
+    return out;
+}
+
+}
+
+// sleep while the word does not change, false when the deadline is past
+bool entry_state::park(uint32_t word, const time_point &deadline)
+{
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline) return false;
+    
+    if ( ! (word & sleepers)) {
+        if ( ! st_word.compare_exchange_strong(word, word | sleepers,
+                std::memory_order_relaxed)) return true;
+        word |= sleepers;
+    }
+    
+    auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        deadline - now).count();
+    timespec timeout;
+    timeout.tv_sec = left / 1000000000;
+    timeout.tv_nsec = left % 1000000000;
+    
+    // the timeout is relative, on the monotonic clock as steady_clock
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&st_word),
+        FUTEX_WAIT_PRIVATE, word, &timeout, nullptr, 0);
+    return true;
+}
+
+void entry_state::wake()
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&st_word),
+        FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// a waiting writer keeps new readers out; past the count the bits can
+// hold, a writer waits without being counted until there is room
+bool entry_state::try_lock_until(const time_point &deadline)
+{
+    if (try_lock()) return true;
+    
+    bool counted = false;
+    
+    for (unsigned n = 0; ; ++n) {
+        uint32_t w = st_word.load(std::memory_order_relaxed);
+        
+        if ((w & (readers | exclusive)) == 0) {
+            uint32_t locked = (counted ? w - writer : w) | exclusive;
+            if (st_word.compare_exchange_weak(w, locked,
+                    std::memory_order_acquire)) return true;
+        } else if ( ! counted && (w & writers) != writers) {
+            counted = st_word.compare_exchange_weak(w, w + writer,
+                std::memory_order_relaxed);
+        } else if (n < spins) {
+            cpu_relax();
+        } else if ( ! park(w, deadline)) {
+            break;
+        }
+    }
+    if ( ! counted) return false;
+    
+    // readers may be waiting for the last writer
+    uint32_t w = st_word.load(std::memory_order_relaxed);
+    uint32_t n;
+    
+    do {
+        n = w - writer;
+        if ((w & writers) == writer) n &= ~sleepers;
+    } while ( ! st_word.compare_exchange_weak(w, n,
+            std::memory_order_relaxed));
+    
+    if ((w & writers) == writer) released(w);
+    return false;
+}
+
+bool entry_state::try_lock_shared_until(const time_point &deadline)
+{
+    for (unsigned n = 0; ; ++n) {
+        uint32_t w = st_word.load(std::memory_order_relaxed);
+        
+        if ((w & (exclusive | writers)) == 0 && (w & readers) != readers) {
+            if (st_word.compare_exchange_weak(w, w + 1,
+                    std::memory_order_acquire)) return true;
+        } else if (n < spins) {
+            cpu_relax();
+        } else if ( ! park(w, deadline)) {
+            return false;
+        }
+    }
+}
+
+bool entry_state::wait_load_state(unsigned state, const time_point &deadline)
+{
+    for (unsigned n = 0; ; ++n) {
+        uint32_t w = st_word.load(std::memory_order_acquire);
+        
+        if ((w >> load_shift) != state) {
+            return true;
+        } else if (n < spins) {
+            cpu_relax();
+        } else if ( ! park(w, deadline)) {
+            return false;
+        }
+    }
+}
+
+// readers wait while there are writing requests; the clock is read
+// only by a wait, the time to get the guard is not counted
+void db_cache::shard::lock_read()
+{
+    std::unique_lock<std::mutex> lk(s_guard);
+    
+    if (s_write_req == 0) {
+        s_lock_wait.add(std::chrono::nanoseconds(0));
+    } else {
+        auto start = std::chrono::steady_clock::now();
+        s_read_lock.wait(lk, [this] {
+            return s_write_req == 0;
+        });
+        s_lock_wait.add_since(start);
+    }
+    ++s_reading;
+}
+
+void db_cache::shard::unlock_read()
+{
+    std::lock_guard<std::mutex> lk(s_guard);
+    --s_reading;
+    s_write_lock.notify_all();
+}
+
+// writers have precedence on readers, one writer at a time:
+// the guard stays locked until unlock_write(); the hold time needs one
+// clock read, a wait another
+void db_cache::shard::lock_write()
+{
+    std::unique_lock<std::mutex> lk(s_guard);
+    ++s_write_req;
+    
+    if (s_reading == 0) {
+        s_write_since = std::chrono::steady_clock::now();
+        s_lock_wait.add(std::chrono::nanoseconds(0));
+    } else {
+        auto start = std::chrono::steady_clock::now();
+        s_write_lock.wait(lk, [this] {
+            return s_reading == 0;
+        });
+        s_write_since = std::chrono::steady_clock::now();
+        s_lock_wait.add(s_write_since - start);
+    }
+    lk.release();
+}
+
+void db_cache::shard::unlock_write()
+{
+    std::unique_lock<std::mutex> lk(s_guard, std::adopt_lock);
+    s_lock_hold.add_since(s_write_since);
+    --s_write_req;
+    if (s_write_req == 0) s_read_lock.notify_all();
+}
+
+// evicted handles go back to the slab two epochs later;
+// call with the shard locked for writing
+size_t db_cache::shard::reclaim()
+{
+    s_epochs.try_advance();
+    
+    auto i = s_retired.begin();
+    
+    for (; i != s_retired.end() && s_epochs.safe(i -> first); ++i) {
+        i -> second -> ~handle();
+        s_slab.deallocate(i -> second);
+    }
+    size_t freed = i - s_retired.begin();
+    s_retired.erase(s_retired.begin(), i);
+    s_cache.reclaim();
+    return freed;
+}
+
+// no readers are left; entries are left in the table only when the
+// destructor gave up storing their data
+db_cache::shard::~shard()
+{
+    for (auto &r : s_retired) r.second -> ~handle();
+    s_cache.for_each([] (handle *h) { h -> ~handle(); });
+}
+
+size_t db_cache::shard_mask(unsigned n)
+{
+    size_t size = 1;
+    while (size < n) size <<= 1;
+    return size - 1;
+}
+
+// percent of the memory budget, without overflow; SIZE_MAX for no budget
+size_t db_cache::byte_limit(const db_cache_options &opt, unsigned percent)
+{
+    if (opt.high_watermark > 100 || opt.low_watermark > opt.high_watermark) {
+        throw std::invalid_argument("db_cache: bad watermarks.");
+    }
+    if (opt.max_bytes == 0) return SIZE_MAX;
+    
+    return opt.max_bytes / 100 * percent
+        + opt.max_bytes % 100 * percent / 100;
+}
+
+db_cache_options db_cache::options(unsigned utime, int timeout,
+    size_t size, unsigned shards)
+{
+    db_cache_options opt;
+    opt.update_time = utime;
+    opt.timeout = timeout;
+    opt.max_size = size;
+    opt.shards = shards;
+    return opt;
+}
+
+// the timer starts after the shards and the worker threads are ready
+db_cache::db_cache(db_backend *c, const db_cache_options &opt) :
+    c_client(c), c_handle_timeout(opt.timeout), c_cache_maxsize(opt.max_size),
+    c_bytes_high(byte_limit(opt, opt.high_watermark)),
+    c_bytes_low(byte_limit(opt, opt.low_watermark)),
+    c_evict_budget(opt.evict_budget), c_shard_mask(shard_mask(opt.shards)),
+    c_shards(new shard[c_shard_mask + 1]), c_cache_size(0), c_retired(0),
+    c_evict_next(0),
+    c_write_queue(std::max<size_t>(opt.write_queue, 1)),
+    c_writer_count(std::max(opt.writers, 1u)),
+    c_writers(new writer[c_writer_count]),
+    c_close_retries(opt.close_retries), c_snapshot(opt.snapshot),
+    c_preload_batch(std::max<size_t>(opt.preload_batch, 1)),
+    c_fetch_exit(false), c_cold_cycles(opt.cold_cycles),
+    c_cold_min_bytes(std::max<size_t>(opt.cold_min_bytes, 1)), c_cycle(0),
+    c_cold_entries(0), c_cold_bytes(0),
+    c_l1_size(opt.l1_size != 0
+        ? shard_mask(unsigned(std::min<size_t>(opt.l1_size, 1u << 20))) + 1
+        : 0),
+    c_id(++cache_ids),
+    c_stamps(c_l1_size != 0 ? new std::atomic<uint64_t>[l1_stamps]() : nullptr),
+    c_timer_exit(false)
+{
+    size_t capacity = opt.max_size / (c_shard_mask + 1) + 1;
+    
+    c_trigger.set_limits(opt.dirty_entries, opt.dirty_bytes);
+    
+    for (size_t n = 0; n <= c_shard_mask; ++n) {
+        c_shards[n].s_policy = make_eviction_policy(opt.policy, capacity);
+        c_shards[n].s_dirty.set_trigger(&c_trigger);
+    }
+    
+    if ( ! opt.wal.empty()) {
+        c_log.reset(new write_log(opt.wal));
+        replay_log();
+        
+        for (size_t n = 0; n <= c_shard_mask; ++n) {
+            c_shards[n].s_dirty.set_log(c_log.get());
+        }
+    }
+    
+    if ( ! c_snapshot.empty()) load_snapshot();
+    
+    for (size_t n = 0; n < c_writer_count; ++n) {
+        writer &w = c_writers[n];
+        w.w_thread = std::thread([this, &w] { writer_loop(w); });
+    }
+    
+    for (unsigned n = 0; n < opt.fetchers; ++n) {
+        c_fetchers.emplace_back([this] { fetch_loop(); });
+    }
+    
+    unsigned utime = opt.update_time;
+    c_timer = std::thread([this, utime] { timer_loop(utime); });
+}
+
+// lock-free, the epoch keeps the handle in memory until it is pinned;
+// an entry evicted meanwhile is looked up again
+handle* db_cache::locate(const std::string &key, size_t hash)
+{
+    shard &s = shard_of(hash);
+    epoch_guard reader(s.s_epochs);
+    
+    for (;;) {
+        handle* h = s.s_cache.find(key, hash);
+        if (h == nullptr) return nullptr;
+        
+        h -> pin();
+        
+        // found in the cache
+        if ( ! h -> evicted()) {
+            h -> set_touched(true);
+            h -> set_used(c_cycle.load(std::memory_order_relaxed));
+            s.s_policy -> accessed(h);
+            return h;
+        }
+        h -> unpin();
+    }
+}
+
+// a lookup which neither touches the entry nor tells the policy,
+// background work must not look like a request
+bool db_cache::cached(const std::string &key, size_t hash)
+{
+    shard &s = shard_of(hash);
+    epoch_guard reader(s.s_epochs);
+    
+    handle* h = s.s_cache.find(key, hash);
+    return h != nullptr && ! h -> evicted();
+}
+
+// a miss inserts a placeholder, data is fetched without holding the shard
+// and concurrent requests for the same key wait for the single loader
+// the loader of a shared request turns its exclusive lock into a shared one
+handle* db_cache::acquire(const std::string &key, bool shared)
+{
+    auto deadline = std::chrono::steady_clock::now() + c_handle_timeout;
+    bool loader = false;
+    size_t hash = std::hash<std::string>()(key);
+    handle *h = locate(key, hash);
+    
+    if (h == nullptr) h = add(key, hash, loader);
+    
+    counters &m = c_stats.local();
+    (loader ? m.m_misses : m.m_hits).add();
+    
+    try {
+        if (loader) {
+            load(key, h);
+            if (shared) h -> unlock_and_lock_shared();
+        } else lock_loaded(h, deadline, shared);
+    } catch (...) {
+        h -> unpin();
+        throw;
     }
     
-    lk.lock();
-    --c_cache_reading;
-    c_write_lock.notify_all();
+    h -> unpin();
     return h;
 }
 
-handle* db_cache::add(const std::string &key)
+// wait for the loader, then lock the data;
+// after a failed load this thread becomes the loader
+void db_cache::lock_loaded(handle *h,
+    const std::chrono::steady_clock::time_point &deadline, bool shared)
+{
+    bool loader;
+    
+    try {
+        loader = h -> wait_loaded(deadline);
+    } catch (db_cache_timeout&) {
+        c_stats.local().m_lock_timeouts.add();
+        throw;
+    }
+    
+    if ( ! loader && shared) {
+        lock_entry(h, deadline, true);
+        return;
+    }
+    
+    try {
+        lock_entry(h, deadline, false);
+    } catch (...) {
+        if (loader) h -> load_failed(std::current_exception());
+        throw;
+    }
+    
+    if (loader) load(h -> key, h);
+    if (shared) h -> unlock_and_lock_shared();
+}
+
+// only a wait reads the clock
+void db_cache::lock_entry(handle *h,
+    const std::chrono::steady_clock::time_point &deadline, bool shared)
+{
+    if ( ! (shared ? h -> try_lock_shared() : h -> try_lock())) {
+        counters &m = c_stats.local();
+        auto start = std::chrono::steady_clock::now();
+        m.m_lock_waits.add();
+        
+        try {
+            if (shared) h -> lock_shared_until(deadline);
+            else h -> lock_until(deadline);
+        } catch (db_cache_timeout&) {
+            m.m_lock_timeouts.add();
+            throw;
+        }
+        m.m_lock_wait.add_since(start);
+    }
+    
+    if ( ! h -> packed()) return;
+    
+    // a cold entry is expanded with the exclusive lock
+    if (shared) {
+        h -> unlock_shared();
+        lock_entry(h, deadline, false);
+        h -> unlock_and_lock_shared();
+        return;
+    }
+    
+    try {
+        unpack(h);
+    } catch (...) {
+        h -> unlock();
+        throw;
+    }
+}
+
+// all the placeholders are inserted first and fetched with one query,
+// then they are unlocked and every entry is locked in key order,
+// so that overlapping batches cannot deadlock
+std::vector<data_handle> db_cache::acquire_many(
+    std::vector<std::string> keys, const std::chrono::milliseconds &timeout)
+{
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    
+    std::vector<handle*> entries;
+    std::vector<handle*> loading;
+    entries.reserve(keys.size());
+    
+    // entries stay pinned until all of them are locked
+    struct unpin_all
+    {
+        std::vector<handle*> &u_list;
+        ~unpin_all() { for (handle *h : u_list) h -> unpin(); }
+    } unpin = { entries };
+    
+    for (auto &key : keys) {
+        bool loader = false;
+        size_t hash = std::hash<std::string>()(key);
+        handle *h = locate(key, hash);
+        
+        if (h == nullptr) h = add(key, hash, loader);
+        if (loader) loading.push_back(h);
+        entries.push_back(h);
+    }
+    
+    counters &m = c_stats.local();
+    m.m_hits.add(entries.size() - loading.size());
+    m.m_misses.add(loading.size());
+    
+    if ( ! loading.empty()) load_many(loading);
+    
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::vector<data_handle> list;
+    list.reserve(entries.size());
+    
+    for (handle *h : entries) {
+        lock_loaded(h, deadline, false);
+        list.emplace_back(h);
+    }
+    return list;
+}
+
+// the loader holds the data locks, placeholders are in key order
+// and they are unlocked when loaded
+void db_cache::load_many(const std::vector<handle*> &loading)
+{
+    std::vector<std::string> keys;
+    std::vector<db_backend::record> rows;
+    
+    keys.reserve(loading.size());
+    for (handle *h : loading) keys.push_back(h -> key);
+    
+    counters &m = c_stats.local();
+    m.m_loads.add(loading.size());
+    
+    try {
+        rows = c_client -> fetch_many(keys);
+        m.m_loaded.add(loading.size());
+    } catch (...) {
+        m.m_loaded.add(loading.size());
+        for (handle *h : loading) {
+            h -> load_failed(std::current_exception());
+            h -> unlock();
+        }
+        throw;
+    }
+    
+    std::sort(rows.begin(), rows.end(),
+        [] (const db_backend::record &a, const db_backend::record &b) {
+            return std::get<0>(a) < std::get<0>(b);
+        });
+    
+    auto row = rows.begin();
+    for (handle *h : loading) {
+        while (row != rows.end() && std::get<0>(*row) < h -> key) ++row;
+        
+        if (row != rows.end() && std::get<0>(*row) == h -> key) {
+            h -> set_value(std::move(std::get<1>(*row)));
+        }
+        h -> account();
+        h -> loaded();
+        h -> unlock();
+    }
+}
+
+// a hit loads only the stamp of the key; a miss reads the entry with a
+// shared lock and takes the stamp with it, a write cannot come in between
+db_backend::value_ptr db_cache::get_value(const std::string &key)
 {
-    std::unique_lock<std::mutex> lk(c_cache_guard);
-    ++c_cache_write_req;
-    c_write_lock.wait(lk, [this] {
-        return c_cache_reading == 0;
+    size_t hash = std::hash<std::string>()(key);
+    l1_slot *slot = nullptr;
+    std::atomic<uint64_t> *stamp = nullptr;
+    
+    if (c_l1_size != 0) {
+        l1_cache &l1 = local_l1();
+        slot = &l1.lc_slots[hash & (c_l1_size - 1)];
+        stamp = &c_stamps[hash & (l1_stamps - 1)];
+        
+        if (slot -> ls_value && slot -> ls_hash == hash
+                && slot -> ls_stamp == stamp -> load(std::memory_order_acquire)
+                && slot -> ls_key == key) {
+            std::atomic<uint64_t> &hits = l1.lc_state -> lc_hits;
+            hits.store(hits.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+            return slot -> ls_value;
+        }
+    }
+    
+    handle *h = acquire(key, true);
+    uint64_t current = stamp ? stamp -> load(std::memory_order_acquire) : 0;
+    db_backend::value_ptr data = h -> share_value();
+    h -> unlock_shared();
+    
+    if (slot == nullptr) return data;
+    
+    slot -> ls_key = key;
+    slot -> ls_hash = hash;
+    slot -> ls_stamp = current;
+    slot -> ls_value = std::make_shared<const std::string>(*data);
+    return slot -> ls_value;
+}
+
+// the L1 caches of destroyed db_caches are dropped here
+db_cache::l1_cache& db_cache::local_l1()
+{
+    static thread_local std::vector<std::unique_ptr<l1_cache>> caches;
+    
+    for (auto &c : caches) {
+        if (c -> lc_cache == c_id) return *c;
+    }
+    
+    caches.erase(std::remove_if(caches.begin(), caches.end(),
+        [] (const std::unique_ptr<l1_cache> &c) {
+            return c -> lc_state -> lc_closed.load();
+        }), caches.end());
+    
+    std::unique_ptr<l1_cache> l1(new l1_cache(c_id, c_l1_size));
+    std::unique_lock<std::mutex> lk(c_l1_guard);
+    c_l1_states.push_back(l1 -> lc_state);
+    lk.unlock();
+    
+    caches.push_back(std::move(l1));
+    return *caches.back();
+}
+
+void db_cache::get_async(const std::string &key, callback done)
+{
+    size_t hash = std::hash<std::string>()(key);
+    handle *h = locate(key, hash);
+    
+    // a hit, if the entry is free there is no need to wait;
+    // a ready entry never goes back to loading
+    if (h != nullptr) {
+        bool locked = h -> is_ready() && h -> try_lock();
+        
+        if (locked && h -> packed()) {
+            try {
+                unpack(h);
+            } catch (...) {
+                h -> unlock();
+                h -> unpin();
+                done(data_handle(), std::current_exception());
+                return;
+            }
+        }
+        h -> unpin();
+        
+        if (locked) {
+            c_stats.local().m_hits.add();
+            done(data_handle(h), nullptr);
+            return;
+        }
+    }
+    
+    auto task = [this, key, done] {
+        data_handle dh;
+        
+        try {
+            dh = acquire(key, false);
+        } catch (...) {
+            done(data_handle(), std::current_exception());
+            return;
+        }
+        done(std::move(dh), nullptr);
+    };
+    
+    run_task(task);
+}
+
+std::future<data_handle> db_cache::get_async(const std::string &key)
+{
+    auto p = std::make_shared<std::promise<data_handle>>();
+    
+    get_async(key, [p] (data_handle &&dh, std::exception_ptr error) {
+        if (error) p -> set_exception(error);
+        else p -> set_value(std::move(dh));
     });
+    return p -> get_future();
+}
+
+// without a pool, wait within the caller
+void db_cache::run_task(std::function<void()> task)
+{
+    if (c_fetchers.empty()) {
+        task();
+        return;
+    }
     
-    auto i = c_cache.find(key);
-    handle* h = nullptr;
+    std::lock_guard<std::mutex> lk(c_fetch_guard);
+    c_fetch_tasks.push_back(std::move(task));
+    c_fetch_ready.notify_one();
+}
+
+bool db_cache::fetch_exit()
+{
+    std::lock_guard<std::mutex> lk(c_fetch_guard);
+    return c_fetch_exit;
+}
+
+std::future<size_t> db_cache::preload(std::vector<std::string> keys)
+{
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
     
-    if (i == c_cache.end()) {
-        h = new handle;
-        h -> set_touched(true);
-        h -> data = c_client -> fetch(key);
-        h -> lock(c_handle_timeout);
-        c_cache[key] = h;
+    auto job = std::make_shared<preload_job>();
+    job -> j_keys = std::move(keys);
+    return start_preload(job);
+}
+
+std::future<size_t> db_cache::preload(const std::string &from,
+    const std::string &to)
+{
+    auto job = std::make_shared<preload_job>();
+    job -> j_range = true;
+    job -> j_from = from;
+    job -> j_to = to;
+    return start_preload(job);
+}
+
+// each batch is a task, so misses of get_async() are served in between
+std::future<size_t> db_cache::start_preload(std::shared_ptr<preload_job> job)
+{
+    std::future<size_t> f = job -> j_done.get_future();
+    
+    if (c_fetchers.empty()) {
+        while (preload_step(*job)) {}
     } else {
-        h = i -> second;
+        preload_task(job);
+    }
+    return f;
+}
+
+void db_cache::preload_task(std::shared_ptr<preload_job> job)
+{
+    run_task([this, job] {
+        if (preload_step(*job)) preload_task(job);
+    });
+}
+
+// a full cache stops preloading
+bool db_cache::full()
+{
+    return c_cache_size >= c_cache_maxsize
+        || (c_bytes_high != SIZE_MAX && memory_usage() >= c_bytes_high);
+}
+
+// fetch and insert one batch, false when the job is over
+bool db_cache::preload_step(preload_job &job)
+{
+    if (full()) {
+        job.j_done.set_value(job.j_added);
+        return false;
+    }
+    
+    std::vector<size_t> evictions(c_shard_mask + 1);
+    record_list rows;
+    bool last;
+    
+    for (size_t n = 0; n <= c_shard_mask; ++n) {
+        evictions[n] = c_shards[n].s_evictions;
+    }
+    
+    try {
+        if (job.j_range) {
+            rows = c_client -> fetch_range(job.j_from, job.j_to,
+                c_preload_batch, job.j_started);
+            last = rows.size() < c_preload_batch;
+            if ( ! rows.empty()) job.j_from = std::get<0>(rows.back());
+            job.j_started = true;
+        } else {
+            std::vector<std::string> keys;
+            
+            while (job.j_next < job.j_keys.size()
+                    && keys.size() < c_preload_batch) {
+                const std::string &key = job.j_keys[job.j_next++];
+                if ( ! cached(key, std::hash<std::string>()(key))) {
+                    keys.push_back(key);
+                }
+            }
+            last = job.j_next == job.j_keys.size();
+            if ( ! keys.empty()) rows = c_client -> fetch_many(keys);
+        }
+    } catch (...) {
+        job.j_done.set_exception(std::current_exception());
+        return false;
+    }
+    
+    bool filled = false;
+    job.j_added += insert_rows(rows, evictions, filled);
+    
+    if (last || filled || fetch_exit()) {
+        job.j_done.set_value(job.j_added);
+        return false;
+    }
+    return true;
+}
+
+// rows of a shard which evicted entries since the fetch are dropped,
+// the database may have accepted newer data for them meanwhile
+size_t db_cache::insert_rows(record_list &rows,
+    const std::vector<size_t> &evictions, bool &filled)
+{
+    std::vector<std::vector<size_t>> by_shard(c_shard_mask + 1);
+    std::vector<size_t> hashes(rows.size());
+    size_t added = 0;
+    
+    for (size_t i = 0; i < rows.size(); ++i) {
+        hashes[i] = std::hash<std::string>()(std::get<0>(rows[i]));
+        by_shard[hashes[i] & c_shard_mask].push_back(i);
+    }
+    
+    for (size_t n = 0; n <= c_shard_mask && ! filled; ++n) {
+        if (by_shard[n].empty()) continue;
+        
+        shard &s = c_shards[n];
+        s.lock_write();
+        
+        if (s.s_evictions == evictions[n]) {
+            for (size_t i : by_shard[n]) {
+                if (full()) {
+                    filled = true;
+                    break;
+                }
+                
+                const std::string &key = std::get<0>(rows[i]);
+                if (s.s_cache.find(key, hashes[i]) != nullptr) continue;
+                
+                insert(s, key, hashes[i], std::move(std::get<1>(rows[i])));
+                ++added;
+            }
+        }
+        
+        s.unlock_write();
+    }
+    
+    return added;
+}
+
+// fetch pool threads run until the queue is empty at exit
+void db_cache::fetch_loop()
+{
+    c_client -> thread_init();
+    
+    for (;;) {
+        std::unique_lock<std::mutex> lk(c_fetch_guard);
+        c_fetch_ready.wait(lk, [this] {
+            return ! c_fetch_tasks.empty() || c_fetch_exit;
+        });
+        if (c_fetch_tasks.empty()) break;
+        
+        std::function<void()> task = std::move(c_fetch_tasks.front());
+        c_fetch_tasks.pop_front();
+        lk.unlock();
+        
+        // a callback which throws has nobody to tell, the pool goes on
+        try {
+            task();
+        } catch (...) {
+        }
+    }
+    
+    c_client -> thread_end();
+}
+
+// the loader holds the data lock
+void db_cache::load(const std::string &key, handle *h)
+{
+    counters &m = c_stats.local();
+    m.m_loads.add();
+    
+    try {
+        h -> set_value(c_client -> fetch(key));
+        m.m_loaded.add();
+    } catch (...) {
+        m.m_loaded.add();
+        h -> load_failed(std::current_exception());
+        h -> unlock();
+        throw;
+    }
+    h -> account();
+    h -> loaded();
+}
+
+// insert a locked placeholder, the caller becomes the loader
+handle* db_cache::add(const std::string &key, size_t hash, bool &loader)
+{
+    shard &s = shard_of(hash);
+    s.lock_write();
+    
+    handle* h = s.s_cache.find(key, hash);
+    
+    if (h == nullptr) {
+        h = insert(s, key, hash, std::string(), true);
+        loader = true;
+    } else {
+        h -> pin();
         h -> set_touched(true);
+        h -> set_used(c_cycle.load(std::memory_order_relaxed));
     }
     
-    --c_cache_write_req;
-    if (c_cache_write_req == 0) c_read_lock.notify_all();
+    s.unlock_write();
+    return h;
+}
+
+// call with the shard locked for writing, the key must not be in the shard;
+// lock-free readers find the entry once inserted, so a placeholder is
+// loading, locked and pinned before
+handle* db_cache::insert(shard &s, const std::string &key, size_t hash,
+    std::string &&data, bool placeholder)
+{
+    void *p = s.s_slab.allocate();
+    handle *h;
+    
+    try {
+        h = new (p) handle(key, hash, &s.s_dirty, &s.s_bytes,
+            c_stamps ? &c_stamps[hash & (l1_stamps - 1)] : nullptr);
+    } catch (...) {
+        s.s_slab.deallocate(p);
+        throw;
+    }
+    
+    h -> set_value(std::move(data));
+    h -> set_used(c_cycle.load(std::memory_order_relaxed));
+    h -> account();
+    
+    if (placeholder) {
+        h -> set_touched(true);
+        h -> start_loading();
+        h -> try_lock();
+        h -> pin();
+    }
+    
+    s.s_cache.insert(h);
+    s.s_policy -> inserted(h);
+    ++c_cache_size;
+    
+    if (over_budget()) c_trigger.raise();
     return h;
 }
 
 // used within the timer loop and in the destructor
+// only the entries in the dirty queues are visited, a busy entry is
+// queued again for the next update; the data is handed over to the
+// writers and stored asynchronously
+// while a writer queue is full, entries are left in the dirty queues
 void db_cache::update_db()
 {
-    std::vector<std::tuple<std::string, std::string>> list;
+    std::lock_guard<std::mutex> collector(c_update_guard);
+    
+    for (size_t n = 0; n < c_writer_count; ++n) {
+        std::lock_guard<std::mutex> lk(c_writers[n].w_guard);
+        if (c_writers[n].w_queue.size() >= c_write_queue) return;
+    }
+    
+    std::vector<write_batch> batches(c_writer_count);
+    write_entry e;
+    
+    // entries queued from now on are counted again, and logged
+    // in a new segment
+    c_trigger.taken();
+    if (c_log) c_log -> rotate();
+    
+    for (size_t n = 0; n <= c_shard_mask; ++n) {
+        shard &s = c_shards[n];
+        
+        for (handle *h : s.s_dirty.take()) {
+            if ( ! h -> try_lock_shared()) {
+                s.s_dirty.push(h, 0);
+                continue;
+            }
+            if (h -> take_changes(e.w_data, e.w_version)) {
+                e.w_handle = h;
+                batches[h -> hash % c_writer_count].push_back(std::move(e));
+            }
+            h -> unlock_shared();
+        }
+    }
+    
+    for (size_t n = 0; n < c_writer_count; ++n) {
+        if (batches[n].empty()) continue;
+        
+        writer &w = c_writers[n];
+        std::lock_guard<std::mutex> lk(w.w_guard);
+        w.w_queue.push_back(std::move(batches[n]));
+        w.w_ready.notify_one();
+    }
+}
+
+// hand over the modified data and wait until it is stored
+void db_cache::flush()
+{
+    update_db();
     
-    auto copy_cache = [this] {
-        std::unique_lock<std::mutex> lk(c_cache_guard);
-        c_read_lock.wait(lk, [this] {
-            return c_cache_write_req == 0;
+    for (size_t n = 0; n < c_writer_count; ++n) {
+        writer &w = c_writers[n];
+        std::unique_lock<std::mutex> lk(w.w_guard);
+        w.w_idle.wait(lk, [&w] { return w.w_queue.empty() && ! w.w_busy; });
+    }
+}
+
+namespace {
+
+// snapshot file: magic, number of entries, then for each entry
+// key size, data size, flags (32, 32 and 8 bits), key and data
+
+const char snapshot_magic[8] = { 'D', 'B', 'C', 'S', 'N', 'A', 'P', '1' };
+
+enum : uint8_t { snapshot_touched = 1, snapshot_dirty = 2 };
+
+template <typename T>
+void put(std::ostream &out, T value)
+{
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+bool get(const char *&p, const char *end, T &value)
+{
+    if (size_t(end - p) < sizeof(value)) return false;
+    std::memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+}
+
+}
+
+void db_cache::snapshot(const std::string &path)
+{
+    const std::string &file = path.empty() ? c_snapshot : path;
+    if (file.empty()) throw std::invalid_argument("Snapshot: no file.");
+    
+    // entries the database has accepted need no mark
+    flush();
+    
+    // no store may pass the data taken from here on
+    std::lock_guard<std::mutex> lk(c_snapshot_guard);
+    
+    std::string tmp = file + ".tmp";
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if ( ! out) throw std::runtime_error("Snapshot: cannot create " + tmp);
+    
+    out.write(snapshot_magic, sizeof(snapshot_magic));
+    put<uint64_t>(out, 0);
+    
+    uint64_t count = 0;
+    std::vector<handle*> pinned;
+    
+    for (size_t n = 0; n <= c_shard_mask; ++n) {
+        shard &s = c_shards[n];
+        
+        s.lock_read();
+        s.s_cache.for_each([&pinned] (handle *h) {
+            h -> pin();
+            pinned.push_back(h);
         });
-        ++c_cache_reading;
-        lk.unlock();
+        s.unlock_read();
         
-        cache_t cache(c_cache);
+        // busy entries are left out, they are fetched after the restart
+        for (handle *h : pinned) {
+            auto deadline = std::chrono::steady_clock::now()
+                + c_handle_timeout;
+            bool locked = false;
+            
+            try {
+                if (h -> is_ready()) {
+                    h -> lock_shared_until(deadline);
+                    locked = true;
+                }
+            } catch (const db_cache_timeout &) {
+            }
+            
+            // the entry is locked only to share its data,
+            // the pin keeps the key
+            db_backend::value_ptr data;
+            uint8_t flags = 0;
+            bool packed = false;
+            size_t raw_size = 0;
+            
+            if (locked && h -> is_ready()) {
+                data = h -> share_value();
+                flags = (h -> touched() ? snapshot_touched : 0)
+                    | (h -> dirty() ? snapshot_dirty : 0);
+                packed = h -> packed();
+                raw_size = h -> raw_size();
+            }
+            if (locked) h -> unlock_shared();
+            
+            if (packed) {
+                data = std::make_shared<std::string>(
+                    expand_data(*data, raw_size));
+            }
+            
+            if (data) {
+                put<uint32_t>(out, h -> key.size());
+                put<uint32_t>(out, data -> size());
+                put<uint8_t>(out, flags);
+                out.write(h -> key.data(), h -> key.size());
+                out.write(data -> data(), data -> size());
+                ++count;
+            }
+            h -> unpin();
+        }
+        pinned.clear();
+    }
+    
+    out.seekp(sizeof(snapshot_magic));
+    put<uint64_t>(out, count);
+    out.close();
+    
+    if ( ! out || std::rename(tmp.c_str(), file.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("Snapshot: cannot write " + file);
+    }
+    
+    auto &files = c_snapshot_files;
+    if (std::find(files.begin(), files.end(), file) == files.end()) {
+        files.push_back(file);
+    }
+}
+
+// called by a writer before a store: the database is going to be newer
+// than the snapshot files, a crash from now on must not load them
+void db_cache::drop_snapshots()
+{
+    std::lock_guard<std::mutex> lk(c_snapshot_guard);
+    for (auto &file : c_snapshot_files) std::remove(file.c_str());
+    c_snapshot_files.clear();
+}
+
+// called by the constructor, before the threads start
+void db_cache::load_snapshot()
+{
+    int fd = ::open(c_snapshot.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    
+    struct stat st;
+    void *map = MAP_FAILED;
+    
+    if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (map == MAP_FAILED) return;
+    ::madvise(map, st.st_size, MADV_SEQUENTIAL);
+    
+    const char *p = static_cast<const char*>(map);
+    const char *end = p + st.st_size;
+    uint64_t count = 0;
+    uint64_t record = 0; // the last one in the log
+    bool modified = false;
+    
+    if (size_t(end - p) >= sizeof(snapshot_magic)
+        && std::memcmp(p, snapshot_magic, sizeof(snapshot_magic)) == 0) {
+        p += sizeof(snapshot_magic);
+        get(p, end, count);
+    }
+    
+    // a damaged file is loaded up to the damage
+    for (; count != 0; --count) {
+        uint32_t key_size, data_size;
+        uint8_t flags;
         
-        lk.lock();
-        --c_cache_reading;
-        c_write_lock.notify_all();
-        return cache;
-    };
+        if ( ! get(p, end, key_size) || ! get(p, end, data_size)
+            || ! get(p, end, flags)
+            || size_t(end - p) < uint64_t(key_size) + data_size) break;
+        
+        // modified entries are always kept, they are stored again
+        bool dirty = flags & snapshot_dirty;
+        
+        if ( ! dirty && (c_cache_size >= c_cache_maxsize
+                         || memory_usage() >= c_bytes_high)) {
+            p += key_size + data_size;
+            continue;
+        }
+        
+        std::string key(p, key_size);
+        p += key_size;
+        std::string data(p, data_size);
+        p += data_size;
+        
+        size_t hash = std::hash<std::string>()(key);
+        shard &s = shard_of(hash);
+        
+        s.lock_write();
+        if (s.s_cache.find(key, hash) == nullptr) {
+            handle *h = insert(s, key, hash, std::move(data));
+            h -> set_touched(flags & snapshot_touched);
+            
+            if (dirty) {
+                modified = true;
+                h -> lock(c_handle_timeout);
+                record = std::max(record, h -> written());
+                h -> unlock();
+            }
+        }
+        s.unlock_write();
+    }
+    
+    ::munmap(map, st.st_size);
     
-    for (auto &t : copy_cache()) {
-        for (;;) try {
-            t.second -> lock(c_handle_timeout);
-            if (t.second -> set_touched(false)) {
-                list.emplace_back(t.first, t.second -> data);
+    // used once, the database moves on from here; modified data is in
+    // the log first, if any, or else the file stays until the next store
+    bool keep = modified && ! c_log;
+    try {
+        if (record != 0) c_log -> wait(record);
+    } catch (const std::runtime_error &) {
+        keep = true;
+    }
+    
+    if (keep) c_snapshot_files.push_back(c_snapshot);
+    else std::remove(c_snapshot.c_str());
+}
+
+// writes lost by a crash are stored before the cache starts, by a thread
+// of its own as the client requires; the snapshot, if any, may be older
+// than the log, it is not loaded
+void db_cache::replay_log()
+{
+    std::vector<db_backend::record> list = c_log -> recover();
+    
+    if ( ! list.empty()) {
+        std::exception_ptr error;
+        
+        std::thread replay([this, &list, &error] {
+            c_client -> thread_init();
+            try {
+                c_client -> store(list);
+            } catch (...) {
+                error = std::current_exception();
             }
-            t.second -> unlock();
-            break;
+            c_client -> thread_end();
+        });
+        replay.join();
+        
+        if (error) std::rethrow_exception(error);
+        if ( ! c_snapshot.empty()) std::remove(c_snapshot.c_str());
+    }
+    c_log -> clear();
+}
+
+// a writer takes all the queued batches at once and stores only the last
+// version of each entry; later batches hold newer versions
+// if the store fails, entries are queued again for the next update
+void db_cache::writer_loop(writer &w)
+{
+    c_client -> thread_init();
+    
+    for (;;) {
+        std::unique_lock<std::mutex> lk(w.w_guard);
+        w.w_ready.wait(lk, [&w] { return ! w.w_queue.empty() || w.w_exit; });
+        if (w.w_queue.empty()) break;
+        
+        std::deque<write_batch> batches;
+        batches.swap(w.w_queue);
+        w.w_busy = true;
+        lk.unlock();
+        
+        std::unordered_map<handle*, write_entry*> latest;
+        for (auto &b : batches) {
+            for (auto &e : b) latest[e.w_handle] = &e;
+        }
+        
+        std::vector<db_backend::shared_record> list;
+        size_t bytes = 0;
+        list.reserve(latest.size());
+        for (auto &l : latest) {
+            bytes += l.first -> key.size() + l.second -> w_data -> size();
+            list.emplace_back(l.first -> key, l.second -> w_data);
+        }
+        
+        counters &m = c_stats.local();
+        auto start = std::chrono::steady_clock::now();
+        
+        try {
+            if (c_log) c_log -> sync();
+            drop_snapshots();
+            c_client -> store(list);
+            for (auto &l : latest) l.first -> stored(l.second -> w_version);
             
-        } catch (db_cache_timeout) {}
+            m.m_flush_time.add_since(start);
+            m.m_flushes.add();
+            m.m_flush_rows.add(list.size());
+            m.m_flush_bytes.add(bytes);
+        } catch (...) {
+            for (auto &l : latest) {
+                l.first -> store_failed(l.second -> w_version,
+                    l.second -> w_data -> size());
+            }
+            m.m_flush_failures.add();
+        }
+        
+        lk.lock();
+        w.w_busy = false;
+        if (w.w_queue.empty()) w.w_idle.notify_all();
     }
-    c_client -> store(list);
+    
+    c_client -> thread_end();
 }
 
-// used within the timer loop and in the destructor
-void db_cache::erase_not_touched(size_t size)
+// stores the remaining data; a failing database is retried with a
+// growing pause, then the data is given up and reported, a log keeps it
+// for the next start
+void db_cache::close_flush()
 {
-    std::unique_lock<std::mutex> lk(c_cache_guard);
+    auto pause = std::chrono::milliseconds(10);
+    unsigned retries = 0;
     
-    if (c_cache.size() < size) return;
+    while (c_cache_size != 0) {
+        uint64_t failures = stats().flush_failures;
+        flush();
+        evict(0, 0);
+        
+        if (stats().flush_failures == failures) continue;
+        
+        if (retries++ == c_close_retries) {
+            std::cerr << "db_cache: the database failed, " << c_cache_size
+                << " entries left, modified data "
+                << (c_log ? "left to the log" : "not stored") << std::endl;
+            return;
+        }
+        std::this_thread::sleep_for(pause);
+        pause *= 2;
+    }
+}
+
+db_cache_stats db_cache::stats()
+{
+    db_cache_stats st;
     
-    ++c_cache_write_req;
-    c_write_lock.wait(lk, [this] {
-        return c_cache_reading == 0;
+    c_stats.for_each([&st] (const counters &m) {
+        st.hits += m.m_hits.get();
+        st.misses += m.m_misses.get();
+        st.loads += m.m_loads.get() - m.m_loaded.get();
+        st.lock_waits += m.m_lock_waits.get();
+        st.lock_timeouts += m.m_lock_timeouts.get();
+        m.m_lock_wait.read(st.lock_wait);
+        st.evictions += m.m_evictions.get();
+        st.evicted_bytes += m.m_evicted_bytes.get();
+        st.flushes += m.m_flushes.get();
+        st.flush_rows += m.m_flush_rows.get();
+        st.flush_bytes += m.m_flush_bytes.get();
+        st.flush_failures += m.m_flush_failures.get();
+        m.m_flush_time.read(st.flush_time);
+        st.compressions += m.m_compressions.get();
+        st.cold_hits += m.m_cold_hits.get();
     });
     
-    auto i = c_cache.begin();
-    while (i != c_cache.end()) {
-        if ( ! i -> second -> touched()) {
-        	delete std::get<1>(*i);
-            i = c_cache.erase(i);
-        } else ++i;
+    for (size_t n = 0; n <= c_shard_mask; ++n) {
+        c_shards[n].s_lock_wait.read(st.shard_wait);
+        c_shards[n].s_lock_hold.read(st.shard_hold);
+    }
+    
+    // a load may start and end while the counters are read
+    if (int64_t(st.loads) < 0) st.loads = 0;
+    st.entries = c_cache_size;
+    st.bytes = memory_usage();
+    st.cold_entries = c_cold_entries;
+    st.cold_bytes = c_cold_bytes;
+    
+    if (c_log) st.wal = c_log -> stats();
+    
+    std::lock_guard<std::mutex> lk(c_l1_guard);
+    for (auto &l1 : c_l1_states) st.l1_hits += l1 -> lc_hits;
+    return st;
+}
+
+size_t db_cache::memory_usage()
+{
+    size_t bytes = 0;
+    for (size_t n = 0; n <= c_shard_mask; ++n) bytes += c_shards[n].s_bytes;
+    return bytes;
+}
+
+// used within the timer loop and in the destructor
+// remove entries until the cache holds at most size entries and bytes;
+// shards are locked one at a time, each of them for c_evict_budget at most,
+// the next call goes on from the following shard
+size_t db_cache::evict(size_t size, size_t bytes)
+{
+    eviction_target target;
+    target.entries = c_cache_size;
+    target.bytes = memory_usage();
+    target.excess = target.entries > size ? target.entries - size : 0;
+    target.excess_bytes = target.bytes > bytes ? target.bytes - bytes : 0;
+    size_t evicted = 0;
+    
+    // shards are visited anyway, to free what was evicted before
+    for (size_t n = 0; n <= c_shard_mask; ++n) {
+        evicted += evict_slice(c_shards[c_evict_next], target);
+        c_evict_next = (c_evict_next + 1) & c_shard_mask;
+    }
+    return evicted;
+}
+
+// each shard gives up its share of the excess entries and bytes,
+// pinned, modified, loading and locked entries are kept
+size_t db_cache::evict_slice(shard &s, const eviction_target &target)
+{
+    using std::chrono::steady_clock;
+    
+    size_t evicted = 0, evicted_bytes = 0;
+    s.lock_write();
+    auto deadline = steady_clock::now() + c_evict_budget;
+    c_retired -= s.reclaim();
+    
+    size_t size = s.s_cache.size();
+    size_t entries = 0, bytes = 0;
+    
+    if (target.excess != 0) {
+        entries = size_t(double(target.excess) * size / target.entries) + 1;
+    }
+    if (target.excess_bytes != 0) {
+        bytes = size_t(double(target.excess_bytes) * s.s_bytes
+            / target.bytes) + 1;
+    }
+    
+    for (size_t n = 0; n < size
+            && (evicted < entries || evicted_bytes < bytes); ++n) {
+        if (steady_clock::now() > deadline) break;
+        
+        // a short walk of the policy, a shard of touched entries
+        // takes many of them
+        handle *h = s.s_policy -> victim(victim_steps);
+        if (h == nullptr) {
+            if (s.s_cache.size() == 0) break;
+            continue;
+        }
+        
+        if (h -> pinned() || ! h -> try_lock()) {
+            s.s_policy -> retained(h);
+            continue;
+        }
+        
+        // the entry cannot be modified while it is checked; a reader may
+        // have pinned it without the shard lock, see locate()
+        bool busy = h -> dirty() || h -> queued() || h -> is_loading();
+        bool cold = h -> packed();
+        
+        if ( ! busy) {
+            h -> set_evicted(true);
+            busy = h -> pinned();
+            if (busy) h -> set_evicted(false);
+        }
+        h -> unlock();
+        
+        if (busy) {
+            s.s_policy -> retained(h);
+            continue;
+        }
+        
+        if (cold) {
+            --c_cold_entries;
+            c_cold_bytes -= h -> footprint();
+        }
+        h -> changed();
+        
+        s.s_policy -> erased(h);
+        s.s_cache.erase(h);
+        s.s_bytes -= h -> footprint();
+        evicted_bytes += h -> footprint();
+        s.s_retired.emplace_back(s.s_epochs.current(), h);
+        ++c_retired;
+        --c_cache_size;
+        ++evicted;
+    }
+    
+    s.s_evictions += evicted;
+    counters &m = c_stats.local();
+    m.m_evictions.add(evicted);
+    m.m_evicted_bytes.add(evicted_bytes);
+    s.unlock_write();
+    return evicted;
+}
+
+// an entry unused for c_cold_cycles sweeps moves to the cold tier; a sweep
+// pins the candidates with the shard locked for reading, then packs them
+// one at a time without the shard lock
+void db_cache::cool()
+{
+    uint32_t cycle = ++c_cycle;
+    std::vector<handle*> pinned;
+    
+    for (size_t n = 0; n <= c_shard_mask; ++n) {
+        shard &s = c_shards[n];
+        
+        s.lock_read();
+        s.s_cache.for_each([&pinned, cycle, this] (handle *h) {
+            if (cycle - h -> used() >= c_cold_cycles) {
+                h -> pin();
+                pinned.push_back(h);
+            }
+        });
+        s.unlock_read();
+        
+        for (handle *h : pinned) {
+            pack(h, cycle);
+            h -> unpin();
+        }
+        pinned.clear();
+    }
+}
+
+// the data is shared with the entry locked, then compressed without the
+// lock; the entry is locked again only to swap the buffers, if its data
+// was not replaced meanwhile. Busy entries wait for the next sweep
+void db_cache::pack(handle *h, uint32_t cycle)
+{
+    db_backend::value_ptr data;
+    
+    if ( ! h -> try_lock_shared()) return;
+    
+    if (h -> is_ready() && ! h -> packed() && ! h -> dirty()
+            && h -> value().size() >= c_cold_min_bytes) {
+        data = h -> share_value();
     }
+    h -> unlock_shared();
+    
+    if ( ! data) return;
     
-    --c_cache_write_req;
-    if (c_cache_write_req == 0) c_read_lock.notify_all();
+    std::string packed = compress_data(*data);
+    
+    // incompressible, tried again after c_cold_cycles
+    if (packed.size() >= data -> size()) {
+        h -> set_used(cycle);
+        return;
+    }
+    
+    if ( ! h -> try_lock()) return;
+    
+    if (h -> same_value(data) && ! h -> dirty()) {
+        h -> set_packed(std::move(packed), data -> size());
+        h -> account();
+        ++c_cold_entries;
+        c_cold_bytes += h -> footprint();
+        c_stats.local().m_compressions.add();
+    }
+    h -> unlock();
+}
+
+// call with the entry locked exclusively, on its first use
+void db_cache::unpack(handle *h)
+{
+    size_t footprint = h -> footprint();
+    
+    h -> set_value(expand_data(h -> value(), h -> raw_size()));
+    h -> account();
+    --c_cold_entries;
+    c_cold_bytes -= footprint;
+    c_stats.local().m_cold_hits.add();
 }
 
 // the timer runs in a dedicated thread
+bool db_cache::over_budget()
+{
+    return c_cache_size > c_cache_maxsize
+        || (c_bytes_high != SIZE_MAX && memory_usage() > c_bytes_high);
+}
+
+// maintenance runs when raised by the trigger, when modified data waits
+// for utime and when the cache is over its budget; otherwise the thread
+// only looks at the queues, and sweeps the cold tier if any, every utime.
+// Runs are at least min_gap apart, so entries which cannot be evicted do
+// not keep it busy
 void db_cache::timer_loop(unsigned utime)
 {
     using std::chrono::milliseconds;
-    using std::chrono::system_clock;
-    using std::chrono::duration_cast;
+    using std::chrono::steady_clock;
     
-    milliseconds ms(utime);
-    auto t0 = system_clock::now();
+    const milliseconds interval(std::max(utime, 1u));
+    const milliseconds min_gap(1);
+    auto last = steady_clock::now();
+    auto last_cool = last;
     
-    c_client -> thread_init();
-    do {
-        auto t1 = system_clock::now();
-        auto dt = duration_cast<milliseconds>(t1 - t0);
-            
-        std::this_thread::sleep_for(ms - dt % ms);
-        erase_not_touched(c_cache_maxsize);
+    while ( ! get_exit()) {
+        auto next = steady_clock::now() + interval;
+        if (c_trigger.entries() != 0) {
+            next = std::min(next, c_trigger.since() + interval);
+        }
+        
+        bool raised = c_trigger.wait_until(next);
+        if (get_exit()) break;
+        
+        auto now = steady_clock::now();
+        
+        // a cold tier cycle is an interval, see cool()
+        if (c_cold_cycles != 0 && now >= last_cool + interval) {
+            cool();
+            last_cool = now;
+        }
+        
+        bool due = raised || over_budget()
+            || (c_trigger.entries() != 0
+                && now >= c_trigger.since() + interval)
+            || (c_retired != 0 && now >= last + interval);
+        if ( ! due) continue;
+        
+        if (now < last + min_gap) std::this_thread::sleep_for(min_gap);
+        last = steady_clock::now();
+        
+        // the memory budget is restored down to the low watermark
+        evict(c_cache_maxsize,
+            memory_usage() > c_bytes_high ? c_bytes_low : SIZE_MAX);
         update_db();
-    } while ( ! get_exit());
-    c_client -> thread_end();
+    }
 }
 
 // runs in the main thread, after all threads are closed
@@ -164,11 +1624,40 @@ db_cache::~db_cache()
     set_exit(true);
     c_timer.join();
     
-    // store remaining data
-    c_client -> thread_init();
-    while( ! c_cache.empty()) {
-        erase_not_touched(0);
-        update_db();
+    // and for pending requests
+    std::unique_lock<std::mutex> lk(c_fetch_guard);
+    c_fetch_exit = true;
+    c_fetch_ready.notify_all();
+    lk.unlock();
+    for (auto &t : c_fetchers) t.join();
+    
+    if ( ! c_snapshot.empty()) {
+        try {
+            snapshot();
+            
+            // nothing is modified from here on, the stores below hold
+            // the data of the file: it stays even if they fail
+            std::lock_guard<std::mutex> lk(c_snapshot_guard);
+            auto &files = c_snapshot_files;
+            files.erase(std::remove(files.begin(), files.end(), c_snapshot),
+                files.end());
+        } catch (...) {
+            // a cold start is still correct
+        }
     }
-    c_client -> thread_end();
+    
+    close_flush();
+    
+    // then stop the writers
+    for (size_t n = 0; n < c_writer_count; ++n) {
+        writer &w = c_writers[n];
+        std::unique_lock<std::mutex> lk(w.w_guard);
+        w.w_exit = true;
+        w.w_ready.notify_one();
+        lk.unlock();
+        w.w_thread.join();
+    }
+    
+    // the threads free the L1 caches
+    for (auto &l1 : c_l1_states) l1 -> lc_closed = true;
 }
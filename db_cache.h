@@ -27,14 +27,27 @@ THE SOFTWARE.
 
 // TODO better organize code
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <exception>
+#include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <vector>
-#include <unordered_map>
+#include "db_backend.h"
+#include "eviction_policy.h"
+#include "handle_table.h"
+#include "metrics.h"
+#include "write_log.h"
 
 struct db_cache_timeout : public std::runtime_error
 {
@@ -47,116 +60,1201 @@ struct db_cache_timeout : public std::runtime_error
     : std::runtime_error(what_arg) {}
 };
 
-class handle
+class handle;
+
+// wakes the maintenance thread when there is work to do: modified data
+// over a threshold, the cache over its budget, or exit
+class maintenance_trigger
 {
-    std::timed_mutex h_data_guard;
-    std::mutex h_touch_guard;
-    bool h_touched;
+    std::mutex mt_guard;
+    std::condition_variable mt_wake;
+    std::atomic<bool> mt_raised;
+    
+    // modified entries and bytes since the last update, approximate
+    std::atomic<size_t> mt_entries;
+    std::atomic<size_t> mt_bytes;
+    std::atomic<std::chrono::steady_clock::rep> mt_since; // the first one
+    size_t mt_max_entries;
+    size_t mt_max_bytes;
     
 public:
+    
+    typedef std::chrono::steady_clock::time_point time_point;
+    
+    maintenance_trigger() :
+        mt_raised(false), mt_entries(0), mt_bytes(0), mt_since(0),
+        mt_max_entries(0), mt_max_bytes(0)
+    {}
+    
+    // 0 for no threshold
+    void set_limits(size_t entries, size_t bytes)
+    {
+        mt_max_entries = entries;
+        mt_max_bytes = bytes;
+    }
+    
+    void raise()
+    {
+        if (mt_raised.load(std::memory_order_relaxed)
+            || mt_raised.exchange(true)) return;
+        
+        std::lock_guard<std::mutex> lk(mt_guard);
+        mt_wake.notify_one();
+    }
+    
+    // an entry joined a dirty queue
+    void queued(size_t bytes)
+    {
+        size_t entries = mt_entries++;
+        if (entries == 0) {
+            mt_since = std::chrono::steady_clock::now()
+                .time_since_epoch().count();
+        }
+        bytes += mt_bytes.fetch_add(bytes);
+        
+        if ((mt_max_entries != 0 && entries + 1 >= mt_max_entries)
+            || (mt_max_bytes != 0 && bytes >= mt_max_bytes)) raise();
+    }
+    
+    // the dirty queues have been taken
+    void taken()
+    {
+        mt_entries = 0;
+        mt_bytes = 0;
+    }
+    
+    size_t entries() const
+    {
+        return mt_entries;
+    }
+    
+    // when the oldest modified entry was queued, if entries() != 0
+    time_point since() const
+    {
+        return time_point(std::chrono::steady_clock::duration(mt_since));
+    }
+    
+    // false on timeout, a raise is cleared
+    bool wait_until(const time_point &deadline)
+    {
+        std::unique_lock<std::mutex> lk(mt_guard);
+        mt_wake.wait_until(lk, deadline, [this] { return mt_raised.load(); });
+        return mt_raised.exchange(false);
+    }
+};
+
+// entries modified since the last database update, and the log
+// of their changes if any
+class dirty_queue
+{
+    std::mutex dq_guard;
+    std::vector<handle*> dq_list;
+    maintenance_trigger *dq_trigger;
+    write_log *dq_log;
+    
+public:
+    
+    dirty_queue() : dq_trigger(nullptr), dq_log(nullptr) {}
+    
+    void set_trigger(maintenance_trigger *t)
+    {
+        dq_trigger = t;
+    }
+    
+    void set_log(write_log *log)
+    {
+        dq_log = log;
+    }
+    
+    write_log* log() const
+    {
+        return dq_log;
+    }
+    
+    void push(handle *h, size_t bytes)
+    {
+        std::unique_lock<std::mutex> lk(dq_guard);
+        dq_list.push_back(h);
+        lk.unlock();
+        
+        if (dq_trigger != nullptr) dq_trigger -> queued(bytes);
+    }
+    
+    std::vector<handle*> take()
+    {
+        std::vector<handle*> list;
+        std::lock_guard<std::mutex> lk(dq_guard);
+        list.swap(dq_list);
+        return list;
+    }
+};
 
-    std::string data;
+// the state of an entry in a single word: a shared/exclusive lock where
+// waiting writers have precedence on new readers, the touched and queued
+// flags and the loading state; waiting threads spin briefly, then sleep
+// on the word (futex) until it changes or the deadline passes
+// a release clears the sleepers bit in the same atomic operation: once the
+// lock is free the entry may be evicted, only the futex call may follow
+class entry_state
+{
+    std::atomic<uint32_t> st_word;
+    
+    bool park(uint32_t word, const std::chrono::steady_clock::time_point &t);
+    void wake();
+    
+    void released(uint32_t old)
+    {
+        if (old & sleepers) wake();
+    }
+    
+    // the new value from the old one, waking the sleepers
+    template <typename F>
+    void release(F change)
+    {
+        uint32_t w = st_word.load(std::memory_order_relaxed);
+        
+        while ( ! st_word.compare_exchange_weak(w, change(w) & ~sleepers,
+                std::memory_order_acq_rel)) {}
+        released(w);
+    }
+    
+public:
+    
+    typedef std::chrono::steady_clock::time_point time_point;
+    
+    static const uint32_t readers = 0xffff; // shared owners
+    static const uint32_t exclusive = 1u << 16;
+    static const uint32_t writer = 1u << 17; // one waiting writer
+    static const uint32_t writers = 0x3ffu << 17; // 1023 at most
+    static const uint32_t sleepers = 1u << 27; // threads in futex wait
+    static const uint32_t touched = 1u << 28;
+    static const uint32_t queued = 1u << 29;
+    static const unsigned load_shift = 30; // two bits, see handle
+    
+    entry_state() : st_word(0) {}
+    
+    bool try_lock()
+    {
+        uint32_t w = st_word.load(std::memory_order_relaxed);
+        
+        while ((w & (readers | exclusive)) == 0) {
+            if (st_word.compare_exchange_weak(w, w | exclusive,
+                    std::memory_order_acquire)) return true;
+        }
+        return false;
+    }
+    
+    bool try_lock_until(const time_point &deadline);
     
     void unlock()
     {
-        h_data_guard.unlock();
+        released(st_word.fetch_and(~(exclusive | sleepers),
+            std::memory_order_release));
     }
     
-    void lock(const std::chrono::milliseconds &timeout)
+    bool try_lock_shared()
+    {
+        uint32_t w = st_word.load(std::memory_order_relaxed);
+        
+        while ((w & (exclusive | writers)) == 0 && (w & readers) != readers) {
+            if (st_word.compare_exchange_weak(w, w + 1,
+                    std::memory_order_acquire)) return true;
+        }
+        return false;
+    }
+    
+    bool try_lock_shared_until(const time_point &deadline);
+    
+    // the last reader wakes the sleepers
+    void unlock_shared()
+    {
+        uint32_t w = st_word.load(std::memory_order_relaxed);
+        uint32_t n;
+        
+        do {
+            n = w - 1;
+            if ((w & readers) == 1) n &= ~sleepers;
+        } while ( ! st_word.compare_exchange_weak(w, n,
+                std::memory_order_release));
+        
+        if ((w & readers) == 1) released(w);
+    }
+    
+    // from exclusive to shared ownership, without releasing the lock
+    void unlock_and_lock_shared()
+    {
+        release([] (uint32_t w) { return w - (exclusive - 1); });
+    }
+    
+    bool test(uint32_t flag) const
+    {
+        return st_word.load(std::memory_order_acquire) & flag;
+    }
+    
+    // the previous value
+    bool set(uint32_t flag, bool value)
+    {
+        uint32_t w = value
+            ? st_word.fetch_or(flag, std::memory_order_acq_rel)
+            : st_word.fetch_and(~flag, std::memory_order_acq_rel);
+        return w & flag;
+    }
+    
+    unsigned load_state() const
+    {
+        return st_word.load(std::memory_order_acquire) >> load_shift;
+    }
+    
+    // waiters on the loading state are woken
+    void set_load_state(unsigned state)
+    {
+        release([state] (uint32_t w) {
+            return (w & ((1u << load_shift) - 1))
+                | (uint32_t(state) << load_shift);
+        });
+    }
+    
+    bool change_load_state(unsigned from, unsigned to)
+    {
+        uint32_t w = st_word.load(std::memory_order_relaxed);
+        uint32_t mask = (1u << load_shift) - 1;
+        
+        while ((w >> load_shift) == from) {
+            if (st_word.compare_exchange_weak(w,
+                    (w & mask) | (uint32_t(to) << load_shift),
+                    std::memory_order_acq_rel)) return true;
+        }
+        return false;
+    }
+    
+    // false on timeout
+    bool wait_load_state(unsigned state, const time_point &deadline);
+};
+
+class handle
+{
+    // data lock, touched and queued flags, loading state
+    // touched: recently used, cleared by the eviction policy
+    // queued: in h_queue, waiting for the next database update
+    entry_state h_state;
+    
+    // dirty: the version in the database is older than h_version
+    dirty_queue *h_queue;
+    std::atomic<unsigned long> h_version; // incremented on every write
+    std::atomic<unsigned long> h_taken; // version handed over to a writer
+    std::atomic<unsigned long> h_stored; // version in the database
+    
+    // written with the data locked exclusively
+    size_t h_footprint; // bytes accounted in h_bytes
+    std::atomic<size_t> *h_bytes; // memory used by the shard
+    
+    // changed with the data, see db_cache::get_value(); nullptr for none
+    std::atomic<uint64_t> *h_stamp;
+    
+    // the last record in the log of the queue, guarded by the log
+    log_ref h_log;
+    
+    // threads holding a pointer to the entry while it is not locked
+    std::atomic<int> h_pins;
+    std::atomic<bool> h_evicted; // see pin()
+    
+    static size_t heap_size(const std::string &s)
     {
-    //    It seems that try_lock_for is buggy
-    //    if ( ! h_data_guard.try_lock_for(timeout)) {
-    //        throw std::db_cache_timeout("Timeout: failed to lock the handle.");
-    //    }
+        const char *p = s.data();
+        const char *object = reinterpret_cast<const char*>(&s);
         
-    //    workaround
-        auto now = std::chrono::system_clock::now();
+        // short strings are stored within the object
+        if (p >= object && p < object + sizeof(s)) return 0;
+        return s.capacity() + 1;
+    }
+    
+    // loading state: a new entry is inserted as a placeholder, data is
+    // fetched outside the container lock and other threads wait for it
+    enum load_state { ready, loading, failed };
+    
+    // shared, a waiter may still read it when a new loader fails
+    std::shared_ptr<std::exception_ptr> h_load_error;
+    
+    // the data, shared without a copy by writers and snapshots which take
+    // a reference with the data locked; a shared buffer is immutable,
+    // the first change after that works on a copy
+    std::shared_ptr<std::string> h_value;
+    
+    // cold tier: the data is compressed, h_raw_size bytes once expanded;
+    // written with the data locked exclusively
+    bool h_packed;
+    size_t h_raw_size;
+    
+    // maintenance cycle of the last access, see db_cache::cool()
+    std::atomic<uint32_t> h_used;
+    
+    // a buffer from make_shared: the string and the control block
+    static const size_t value_overhead =
+        sizeof(std::string) + 2 * sizeof(void*);
+    
+    // empty data of new entries, never changed in place
+    static const std::shared_ptr<std::string>& empty_value()
+    {
+        static const std::shared_ptr<std::string> empty =
+            std::make_shared<std::string>();
+        return empty;
+    }
+    
+public:
+
+    const std::string key;
+    const size_t hash; // of key
+    
+    // eviction policy hooks, guarded by the shard writer lock
+    handle *policy_prev;
+    handle *policy_next;
+    unsigned char policy_segment;
+    
+    // approximate memory used by the container for each entry,
+    // a table slot at the average load
+    static const size_t entry_overhead = 48;
+    
+    handle(const std::string &k, size_t kh, dirty_queue *q,
+        std::atomic<size_t> *bytes, std::atomic<uint64_t> *stamp) :
+        h_queue(q), h_version(0), h_taken(0), h_stored(0), h_footprint(0),
+        h_bytes(bytes), h_stamp(stamp), h_pins(0), h_evicted(false),
+        h_value(empty_value()), h_packed(false), h_raw_size(0), h_used(0),
+        key(k), hash(kh), policy_prev(), policy_next(), policy_segment(0)
+    {}
+    
+    // call with the data locked, the compressed data if packed()
+    const std::string& value() const
+    {
+        return *h_value;
+    }
+    
+    // call with the data locked exclusively; no reference is taken
+    // meanwhile, so a buffer found unshared stays so, and the fence
+    // orders the reads of its last other owner before the changes
+    std::string& mutable_value()
+    {
+        if (h_value.use_count() != 1) {
+            h_value = std::make_shared<std::string>(*h_value);
+        } else std::atomic_thread_fence(std::memory_order_acquire);
+        return *h_value;
+    }
+    
+    // call with the data locked exclusively, data is moved, not copied
+    void set_value(std::string &&data)
+    {
+        if (data.empty()) h_value = empty_value();
+        else h_value = std::make_shared<std::string>(std::move(data));
+        h_packed = false;
+    }
+    
+    // call with the data locked exclusively, see set_value()
+    void set_packed(std::string &&data, size_t raw_size)
+    {
+        h_value = std::make_shared<std::string>(std::move(data));
+        h_packed = true;
+        h_raw_size = raw_size;
+    }
+    
+    // call with the data locked
+    bool packed() const
+    {
+        return h_packed;
+    }
+    
+    size_t raw_size() const
+    {
+        return h_raw_size;
+    }
+    
+    // the data was not replaced since it was shared
+    bool same_value(const db_backend::value_ptr &data) const
+    {
+        return h_value == data;
+    }
+    
+    // a hit in the same cycle does not write
+    void set_used(uint32_t cycle)
+    {
+        if (h_used.load(std::memory_order_relaxed) != cycle) {
+            h_used.store(cycle, std::memory_order_relaxed);
+        }
+    }
+    
+    uint32_t used() const
+    {
+        return h_used.load(std::memory_order_relaxed);
+    }
+    
+    // call with the data locked, the buffer is not changed from now on
+    db_backend::value_ptr share_value() const
+    {
+        return h_value;
+    }
+    
+    // approximate memory used by the entry, as last accounted
+    size_t footprint() const
+    {
+        return h_footprint;
+    }
+    
+    // call with the data locked exclusively, after data has changed
+    void account()
+    {
+        size_t bytes = sizeof(handle) + entry_overhead + heap_size(key);
         
-        if ( ! h_data_guard.try_lock_until(now + timeout)) {
+        if (h_value != empty_value()) {
+            bytes += value_overhead + heap_size(*h_value);
+        }
+        
+        if (bytes > h_footprint) *h_bytes += bytes - h_footprint;
+        else if (bytes < h_footprint) *h_bytes -= h_footprint - bytes;
+        h_footprint = bytes;
+    }
+    
+    void unlock()
+    {
+        h_state.unlock();
+    }
+    
+    void lock(const std::chrono::milliseconds &timeout)
+    {
+        lock_until(std::chrono::steady_clock::now() + timeout);
+    }
+    
+    bool try_lock()
+    {
+        return h_state.try_lock();
+    }
+    
+    void lock_until(const std::chrono::steady_clock::time_point &deadline)
+    {
+        if ( ! h_state.try_lock_until(deadline)) {
             throw db_cache_timeout("Timeout: failed to lock the handle.");
         }
     }
     
+    // shared locking, for reading only
+    
+    void unlock_shared()
+    {
+        h_state.unlock_shared();
+    }
+    
+    bool try_lock_shared()
+    {
+        return h_state.try_lock_shared();
+    }
+    
+    void lock_shared_until(
+        const std::chrono::steady_clock::time_point &deadline)
+    {
+        if ( ! h_state.try_lock_shared_until(deadline)) {
+            throw db_cache_timeout("Timeout: failed to lock the handle.");
+        }
+    }
+    
+    void unlock_and_lock_shared()
+    {
+        h_state.unlock_and_lock_shared();
+    }
+    
+    // a pinned entry is not evicted; without the shard lock, the entry
+    // can be used if it is not evicted once pinned: eviction marks it,
+    // then looks for pins and drops the mark if it finds any
+    void pin() { ++h_pins; }
+    void unpin() { --h_pins; }
+    bool pinned() const { return h_pins != 0; }
+    bool evicted() const { return h_evicted; }
+    void set_evicted(bool flag) { h_evicted = flag; }
+    
     bool touched()
     {
-        std::lock_guard<std::mutex> lk(h_touch_guard);
-        return h_touched;
+        return h_state.test(entry_state::touched);
     }
     
+    // a hit on a touched entry does not write the word
     bool set_touched(bool flag)
     {
-        std::lock_guard<std::mutex> lk(h_touch_guard);
-        bool old = h_touched;
-        h_touched = flag;
-        return old;
+        if (flag && h_state.test(entry_state::touched)) return true;
+        return h_state.set(entry_state::touched, flag);
+    }
+    
+    // a dirty entry is not evicted
+    bool dirty()
+    {
+        return h_stored != h_version;
+    }
+    
+    // nor a queued one, its dirty queue still points to it
+    bool queued()
+    {
+        return h_state.test(entry_state::queued);
+    }
+    
+    // snapshots of the data taken before are stale
+    void changed()
+    {
+        if (h_stamp != nullptr) {
+            h_stamp -> fetch_add(1, std::memory_order_release);
+        }
+    }
+    
+    /*!
+        \brief Call with the data locked exclusively, after data has been
+        modified.
+        
+        With a log, the record is appended with the entry locked, so the
+        records of a key are in version order.
+        
+        \return the number of the record, 0 without a log.
+    */
+    uint64_t written()
+    {
+        account();
+        changed();
+        unsigned long version = ++h_version;
+        if ( ! h_state.set(entry_state::queued, true)) {
+            h_queue -> push(this, h_value -> size());
+        }
+        
+        write_log *log = h_queue -> log();
+        if (log == nullptr) return 0;
+        return log -> append(key, *h_value, h_log, version);
+    }
+    
+    write_log* log() const
+    {
+        return h_queue -> log();
+    }
+    
+    /*!
+        \brief Take the data for database update.
+        
+        Call with the data locked, after the entry has been taken out of
+        its dirty queue. Shared locking is enough since only the database
+        update changes the taken version.
+        
+        \return false if the version is already in the database or taken;
+        a failed store queues the entry again while a later batch may
+        still store the version, a writer must not hold a clean entry.
+    */
+    bool take_changes(db_backend::value_ptr &copy, unsigned long &version)
+    {
+        h_state.set(entry_state::queued, false);
+        if (h_taken == h_version || h_stored == h_version) return false;
+        h_taken = version = h_version;
+        
+        copy = h_value;
+        return true;
+    }
+    
+    // the taken version is in the database; its record is released
+    // first, the entry may be evicted once it is not dirty
+    void stored(unsigned long version)
+    {
+        if (h_queue -> log() != nullptr) {
+            h_queue -> log() -> stored(h_log, version);
+        }
+        
+        unsigned long v = h_stored;
+        while (version > v && ! h_stored.compare_exchange_weak(v, version)) {}
+    }
+    
+    // the taken version could not be stored, take it again, unless a
+    // later version is handed over already and stores the data;
+    // called without the data lock, bytes is the size of that version
+    void store_failed(unsigned long version, size_t bytes)
+    {
+        if ( ! h_taken.compare_exchange_strong(version, h_stored.load())) {
+            return;
+        }
+        if ( ! h_state.set(entry_state::queued, true)) {
+            h_queue -> push(this, bytes);
+        }
+    }
+    
+    // the caller of start_loading() or of a wait_loaded() returning true
+    // is the loader and must call loaded() or load_failed()
+    void start_loading()
+    {
+        h_state.set_load_state(loading);
+    }
+    
+    bool is_loading()
+    {
+        return h_state.load_state() == loading;
+    }
+    
+    bool is_ready()
+    {
+        return h_state.load_state() == ready;
+    }
+    
+    void loaded()
+    {
+        std::atomic_store(&h_load_error,
+            std::shared_ptr<std::exception_ptr>());
+        h_state.set_load_state(ready);
+    }
+    
+    void load_failed(std::exception_ptr error)
+    {
+        std::atomic_store(&h_load_error,
+            std::make_shared<std::exception_ptr>(error));
+        h_state.set_load_state(failed);
+    }
+    
+    /*!
+        \brief Wait for the loader to fetch data.
+        
+        Threads waiting for a load which fails get its error. A thread
+        finding a failed load becomes the new loader and retries.
+        
+        \return true if the caller is the new loader.
+    */
+    bool wait_loaded(const std::chrono::steady_clock::time_point &deadline)
+    {
+        if (h_state.change_load_state(failed, loading)) return true;
+        
+        // a new loader may have taken over a failed load meanwhile
+        for (;;) {
+            if ( ! h_state.wait_load_state(loading, deadline)) {
+                throw db_cache_timeout("Timeout: failed to load the handle.");
+            }
+            
+            unsigned state = h_state.load_state();
+            if (state == ready) return false;
+            
+            if (state == failed) {
+                std::shared_ptr<std::exception_ptr> error =
+                    std::atomic_load(&h_load_error);
+                if (error) std::rethrow_exception(*error);
+            }
+        }
     }
 };
 
 // handle locking
+// writing through modify() marks the data as modified
 class data_handle
 {
     handle* h_data;
+    bool h_written;
+    
+    // with a log, a write is complete once its record is on disk;
+    // the entry may be evicted after the unlock, the log is not;
+    // a failed commit is counted by the log, the writers store the data
+    // only once a later commit has written the record
+    void release()
+    {
+        if (h_data == nullptr) return;
+        uint64_t record = h_written ? h_data -> written() : 0;
+        write_log *log = h_data -> log();
+        h_data -> unlock();
+        
+        if (record != 0) {
+            try {
+                log -> wait(record);
+            } catch (const std::runtime_error &) {
+            }
+        }
+    }
     
 public:
-    data_handle() : h_data() {}
-    ~data_handle() { h_data -> unlock(); }
-    data_handle(data_handle&& dh) : h_data(dh.h_data) {}
-    data_handle(handle *d) : h_data(d) {}
+    data_handle() : h_data(), h_written(false) {}
+    ~data_handle() { release(); }
+    data_handle(handle *d) : h_data(d), h_written(false) {}
+    
+    data_handle(data_handle&& dh) :
+        h_data(dh.h_data), h_written(dh.h_written)
+    {
+        dh.h_data = nullptr;
+    }
     
     data_handle(const data_handle&) = delete;
     
     data_handle& operator = (data_handle&& dh)
     {
-        h_data = dh.h_data;
+        if (this != &dh) {
+            release();
+            h_data = dh.h_data;
+            h_written = dh.h_written;
+            dh.h_data = nullptr;
+        }
+        return *this;
+    }
+    
+    // read only access, it does not mark the data as modified
+    const std::string& operator * () const
+    {
+        return h_data -> value();
+    }
+    
+    // the data is copied first if a writer or a snapshot shares it
+    std::string& modify()
+    {
+        h_written = true;
+        return h_data -> mutable_value();
+    }
+    
+    const std::string& value() const
+    {
+        return h_data -> value();
+    }
+    
+    const std::string& key() const
+    {
+        return h_data -> key;
+    }
+};
+
+// shared handle locking, read only access
+class read_handle
+{
+    handle* h_data;
+    
+public:
+    read_handle() : h_data() {}
+    ~read_handle() { if (h_data != nullptr) h_data -> unlock_shared(); }
+    read_handle(handle *d) : h_data(d) {}
+    
+    read_handle(read_handle&& rh) : h_data(rh.h_data)
+    {
+        rh.h_data = nullptr;
+    }
+    
+    read_handle(const read_handle&) = delete;
+    
+    read_handle& operator = (read_handle&& rh)
+    {
+        if (this != &rh) {
+            if (h_data != nullptr) h_data -> unlock_shared();
+            h_data = rh.h_data;
+            rh.h_data = nullptr;
+        }
         return *this;
     }
     
-    std::string& operator * ()
+    const std::string& operator * () const
     {
-        return h_data -> data;
+        return h_data -> value();
+    }
+    
+    const std::string& value() const
+    {
+        return h_data -> value();
     }
 };
 
-class mysql_client;
+/*!
+    \brief Entries locked as a group, see db_cache::lock_many().
+    
+    The handles are sorted by key. All of them are released together,
+    when the group is destroyed or by release().
+*/
+class data_group
+{
+    std::vector<data_handle> g_handles;
+    
+public:
+    typedef std::vector<data_handle>::iterator iterator;
+    
+    data_group() {}
+    
+    explicit data_group(std::vector<data_handle> &&list) :
+        g_handles(std::move(list))
+    {}
+    
+    data_group(data_group&& g) : g_handles(std::move(g.g_handles)) {}
+    data_group(const data_group&) = delete;
+    
+    data_group& operator = (data_group&& g)
+    {
+        g_handles = std::move(g.g_handles);
+        return *this;
+    }
+    
+    size_t size() const { return g_handles.size(); }
+    
+    data_handle& operator [] (size_t n) { return g_handles[n]; }
+    
+    iterator begin() { return g_handles.begin(); }
+    iterator end() { return g_handles.end(); }
+    
+    // nullptr if the key is not in the group
+    data_handle* find(const std::string &key)
+    {
+        auto i = std::lower_bound(g_handles.begin(), g_handles.end(), key,
+            [] (const data_handle &h, const std::string &k) {
+                return h.key() < k;
+            });
+        return i != g_handles.end() && i -> key() == key ? &*i : nullptr;
+    }
+    
+    data_handle& at(const std::string &key)
+    {
+        data_handle *h = find(key);
+        if (h == nullptr) throw std::out_of_range("Key not in the group.");
+        return *h;
+    }
+    
+    // unlock all the entries now
+    void release() { g_handles.clear(); }
+};
+
+// cache parameters
+struct db_cache_options
+{
+    unsigned update_time; // longest wait of modified data, in ms
+    size_t dirty_entries; // modified entries which start an update, 0 none
+    size_t dirty_bytes; // modified bytes which start an update, 0 none
+    int timeout; // for data lock, in ms
+    size_t max_size; // when start to clean the cache, in entries
+    size_t max_bytes; // memory budget, 0 for no limit
+    unsigned high_watermark; // start to clean above, in % of max_bytes
+    unsigned low_watermark; // clean down to, in % of max_bytes, at most
+                            // high_watermark
+    unsigned shards; // rounded up to a power of two
+    eviction policy; // which entries to remove first
+    unsigned evict_budget; // longest shard lock for eviction, in us
+    unsigned writers; // threads storing modified data
+    size_t write_queue; // batches waiting for each writer
+    unsigned close_retries; // failed stores the destructor tries again,
+                            // waiting twice as long each time
+    unsigned fetchers; // threads serving the misses of get_async()
+    std::string snapshot; // file for warm restarts, empty for none
+    size_t preload_batch; // entries fetched and inserted at once by preload()
+    unsigned cold_cycles; // maintenance cycles unused before compression
+                          // of an entry, 0 for no cold tier
+    size_t cold_min_bytes; // smallest data compressed
+    size_t l1_size; // entries of the L1 cache of each thread, 0 for none,
+                    // see db_cache::get_value()
+    std::string wal; // write-ahead log, path of its segments, empty for none
+    
+    db_cache_options() :
+        update_time(1000), dirty_entries(1000), dirty_bytes(1 << 24),
+        timeout(100), max_size(10000), max_bytes(0),
+        high_watermark(95), low_watermark(85), shards(16),
+        policy(eviction::clock), evict_budget(1000), writers(1),
+        write_queue(4), close_retries(5), fetchers(2), preload_batch(1000),
+        cold_cycles(0), cold_min_bytes(256), l1_size(0)
+    {}
+};
+
+// counters since the cache was created, see db_cache::stats()
+struct db_cache_stats
+{
+    uint64_t hits; // requests served by a cached entry
+    uint64_t misses; // requests which loaded the entry
+    uint64_t loads; // entries being fetched now
+    uint64_t lock_waits; // requests which found the entry locked
+    uint64_t lock_timeouts; // waits for a lock or a load
+    latency_stats lock_wait; // waits which got the lock
+    uint64_t evictions;
+    uint64_t evicted_bytes;
+    uint64_t flushes; // batches stored by the writers
+    uint64_t flush_rows;
+    uint64_t flush_bytes;
+    uint64_t flush_failures;
+    latency_stats flush_time;
+    latency_stats shard_wait; // to lock a container
+    latency_stats shard_hold; // a container locked for writing
+    uint64_t compressions; // entries moved to the cold tier
+    uint64_t cold_hits; // requests which expanded a cold entry
+    uint64_t l1_hits; // get_value() calls served by an L1 cache
+    size_t entries;
+    size_t bytes; // see db_cache::memory_usage()
+    size_t cold_entries; // compressed now
+    size_t cold_bytes; // used by the cold entries, included in bytes
+    write_log_stats wal; // zero without a log
+    
+    db_cache_stats() :
+        hits(0), misses(0), loads(0), lock_waits(0), lock_timeouts(0),
+        evictions(0), evicted_bytes(0), flushes(0), flush_rows(0),
+        flush_bytes(0), flush_failures(0), compressions(0), cold_hits(0),
+        l1_hits(0), entries(0), bytes(0), cold_entries(0), cold_bytes(0)
+    {}
+};
 
 class db_cache
 {
-    mysql_client *c_client;
+    db_backend *c_client;
     
     // cache code
     
-    typedef std::unordered_map<
-        std::string,
-        handle*
-    > cache_t;
+    // a slice of the cache, selected by key hash
+    // each shard has its own container and its own readers/writers state,
+    // so a writer on one shard never stalls readers on the others
+    struct shard
+    {
+        epoch_domain s_epochs; // lock-free readers of s_cache
+        handle_table s_cache;
+        handle_slab s_slab; // memory for the handles in s_cache
+        
+        // evicted handles, by epoch, freed when no reader sees them
+        std::vector<std::pair<uint64_t, handle*>> s_retired;
+        dirty_queue s_dirty;
+        std::unique_ptr<eviction_policy> s_policy;
+        std::atomic<size_t> s_bytes; // see handle::account()
+        std::atomic<size_t> s_evictions; // changes with the shard locked
+        
+        std::mutex s_guard;
+        std::condition_variable s_read_lock;
+        std::condition_variable s_write_lock;
+        int s_reading; // number of readers
+        int s_write_req; // requests for writing
+        
+        // updated with s_guard held, the lock is shared anyway
+        stat_latency s_lock_wait;
+        stat_latency s_lock_hold;
+        std::chrono::steady_clock::time_point s_write_since;
+        
+        shard() :
+            s_cache(s_epochs), s_bytes(0), s_evictions(0), s_reading(0),
+            s_write_req(0)
+        {}
+        
+        ~shard();
+        
+        size_t reclaim();
+        
+        void lock_read();
+        void unlock_read();
+        void lock_write();
+        void unlock_write();
+    };
     
-    cache_t c_cache;
     const std::chrono::milliseconds c_handle_timeout;
     const size_t c_cache_maxsize;
+    const size_t c_bytes_high; // start to evict above
+    const size_t c_bytes_low; // evict down to
+    const std::chrono::microseconds c_evict_budget;
+    const size_t c_shard_mask; // number of shards - 1, a power of two - 1
+    std::unique_ptr<shard[]> c_shards;
+    std::atomic<size_t> c_cache_size; // entries in all the shards
+    std::atomic<size_t> c_retired; // evicted, not freed yet
+    size_t c_evict_next; // first shard of the next eviction
+    
+    static size_t shard_mask(unsigned n);
+    static size_t byte_limit(const db_cache_options &opt, unsigned percent);
+    
+    static db_cache_options options(unsigned utime, int timeout,
+        size_t size, unsigned shards);
+    
+    shard& shard_of(size_t hash)
+    {
+        return c_shards[hash & c_shard_mask];
+    }
     
-    handle* locate(const std::string &key);
-    handle* add(const std::string &key);
-    void erase_not_touched(size_t size);
+    handle* acquire(const std::string &key, bool shared);
+    std::vector<data_handle> acquire_many(std::vector<std::string> keys,
+        const std::chrono::milliseconds &timeout);
+    handle* locate(const std::string &key, size_t hash);
+    bool cached(const std::string &key, size_t hash);
+    handle* add(const std::string &key, size_t hash, bool &loader);
+    handle* insert(shard &s, const std::string &key, size_t hash,
+        std::string &&data, bool placeholder = false);
+    void load(const std::string &key, handle *h);
+    void load_many(const std::vector<handle*> &loading);
+    void lock_loaded(handle *h,
+        const std::chrono::steady_clock::time_point &deadline, bool shared);
+    void lock_entry(handle *h,
+        const std::chrono::steady_clock::time_point &deadline, bool shared);
+    
+    // totals and excess when eviction starts
+    struct eviction_target
+    {
+        size_t entries, excess;
+        size_t bytes, excess_bytes;
+    };
+    
+    // entries looked at by the policy between two checks of the budget
+    static const size_t victim_steps = 32;
+    
+    size_t evict(size_t size, size_t bytes);
+    size_t evict_slice(shard &s, const eviction_target &target);
+    std::mutex c_update_guard; // one collector at a time, keeps versions
+                               // of a key in order across the writers
     void update_db();
+    void flush();
     
-    // cache locking
+    // write-behind code
     
-    std::mutex c_cache_guard;
-    std::condition_variable c_read_lock;
-    std::condition_variable c_write_lock;
-    int c_cache_reading; // number of readers
-    int c_cache_write_req; // requests for writing
+    struct write_entry
+    {
+        handle *w_handle;
+        unsigned long w_version;
+        db_backend::value_ptr w_data;
+    };
+    
+    typedef std::vector<write_entry> write_batch;
+    
+    // a writer thread with its bounded queue of batches,
+    // entries are assigned to writers by key hash
+    struct writer
+    {
+        std::mutex w_guard;
+        std::condition_variable w_ready; // a batch or exit
+        std::condition_variable w_idle; // queue empty, nothing to store
+        std::deque<write_batch> w_queue;
+        bool w_busy;
+        bool w_exit;
+        std::thread w_thread;
+        
+        writer() : w_busy(false), w_exit(false) {}
+    };
+    
+    const size_t c_write_queue;
+    const size_t c_writer_count;
+    std::unique_ptr<writer[]> c_writers;
+    const unsigned c_close_retries;
+    
+    void writer_loop(writer &w);
+    void close_flush();
+    
+    // write-ahead log code, see db_cache_options::wal
+    
+    std::unique_ptr<write_log> c_log;
+    
+    void replay_log();
+    
+    // warm restart code, see snapshot()
+    
+    const std::string c_snapshot;
+    std::mutex c_snapshot_guard; // held by snapshot() while it writes
+    std::vector<std::string> c_snapshot_files; // written, no store since
+    
+    void load_snapshot();
+    void drop_snapshots();
+    
+    // preload code
+    
+    // key, data, see db_backend::record
+    typedef std::vector<std::tuple<std::string, std::string>> record_list;
+    
+    // a preload in progress, a key list or a key range
+    struct preload_job
+    {
+        bool j_range;
+        std::vector<std::string> j_keys; // sorted
+        size_t j_next; // first key of the next batch
+        std::string j_from, j_to; // the rest of the range
+        bool j_started; // j_from was the last key of a batch
+        size_t j_added;
+        std::promise<size_t> j_done;
+        
+        preload_job() :
+            j_range(false), j_next(0), j_started(false), j_added(0)
+        {}
+    };
+    
+    const size_t c_preload_batch;
+    
+    bool full();
+    bool preload_step(preload_job &job);
+    size_t insert_rows(record_list &rows,
+        const std::vector<size_t> &evictions, bool &filled);
+    std::future<size_t> start_preload(std::shared_ptr<preload_job> job);
+    void preload_task(std::shared_ptr<preload_job> job);
+    
+    // fetch pool code, see get_async()
+    
+    std::mutex c_fetch_guard;
+    std::condition_variable c_fetch_ready;
+    std::deque<std::function<void()>> c_fetch_tasks;
+    bool c_fetch_exit;
+    std::vector<std::thread> c_fetchers;
+    
+    void fetch_loop();
+    void run_task(std::function<void()> task);
+    bool fetch_exit();
+    
+    // cold tier code, see cool()
+    
+    const unsigned c_cold_cycles;
+    const size_t c_cold_min_bytes;
+    std::atomic<uint32_t> c_cycle; // maintenance cycles, see handle::used()
+    std::atomic<size_t> c_cold_entries;
+    std::atomic<size_t> c_cold_bytes; // footprint of the cold entries
+    
+    void cool();
+    void pack(handle *h, uint32_t cycle);
+    void unpack(handle *h);
+    
+    // L1 cache code, see get_value()
+    
+    // a snapshot of the data, valid while the stamp of its key is unchanged
+    struct l1_slot
+    {
+        std::string ls_key;
+        size_t ls_hash;
+        uint64_t ls_stamp;
+        db_backend::value_ptr ls_value; // a copy owned by the thread
+    };
+    
+    // shared by an L1 cache and its db_cache, which keeps it for stats()
+    struct l1_state
+    {
+        std::atomic<uint64_t> lc_hits; // written by the thread only
+        std::atomic<bool> lc_closed; // the db_cache is destroyed
+        
+        l1_state() : lc_hits(0), lc_closed(false) {}
+    };
+    
+    // owned by its thread, direct mapped by key hash
+    struct l1_cache
+    {
+        uint64_t lc_cache; // see c_id
+        std::vector<l1_slot> lc_slots;
+        std::shared_ptr<l1_state> lc_state;
+        
+        l1_cache(uint64_t id, size_t size) :
+            lc_cache(id), lc_slots(size), lc_state(new l1_state())
+        {}
+    };
+    
+    // keys share a stamp by hash, a write to one of them
+    // invalidates the snapshots of all of them
+    static const size_t l1_stamps = 1 << 14;
+    
+    const size_t c_l1_size; // a power of two, 0 for none
+    const uint64_t c_id; // tells the caches apart in the threads
+    std::unique_ptr<std::atomic<uint64_t>[]> c_stamps;
+    std::mutex c_l1_guard;
+    std::vector<std::shared_ptr<l1_state>> c_l1_states;
+    
+    l1_cache& local_l1();
+    
+    // statistics code, see stats()
+    
+    struct counters
+    {
+        stat_counter m_hits, m_misses;
+        stat_counter m_loads, m_loaded; // started, ended
+        stat_counter m_lock_waits, m_lock_timeouts;
+        stat_latency m_lock_wait;
+        stat_counter m_evictions, m_evicted_bytes;
+        stat_counter m_flushes, m_flush_rows, m_flush_bytes;
+        stat_counter m_flush_failures;
+        stat_latency m_flush_time;
+        stat_counter m_compressions, m_cold_hits;
+    };
+    
+    striped<counters> c_stats;
     
     // timer code
     
     bool c_timer_exit;
     std::thread c_timer;
     std::mutex guard;
+    maintenance_trigger c_trigger;
     
     void set_exit(bool flag)
     {
-        std::lock_guard<std::mutex> lk(guard);
+        std::unique_lock<std::mutex> lk(guard);
         c_timer_exit = flag;
+        lk.unlock();
+        c_trigger.raise();
     }
     
     bool get_exit()
@@ -165,6 +1263,7 @@ class db_cache
         return c_timer_exit;
     }
     
+    bool over_budget();
     void timer_loop(unsigned utime);
     
 public:
@@ -172,29 +1271,168 @@ public:
     /*!
         \brief Instantiate a cache.
         
-        \param c a database connection.
+        \param c the database, a mysql_client or another backend.
         \param utime time interval for db to update, in ms.
         \param timeout for data lock.
         \param size when start to clean the cache.
+        \param shards number of shards, rounded up to a power of two.
     */
-    db_cache(mysql_client *c, unsigned utime, int timeout, size_t size) :
-        c_client(c), c_handle_timeout(timeout), c_cache_maxsize(size),
-        c_cache_reading(0), c_cache_write_req(0), c_timer_exit(false),
-        c_timer([this, utime] { timer_loop(utime); })
+    db_cache(db_backend *c, unsigned utime, int timeout, size_t size,
+        unsigned shards = 16) :
+        db_cache(c, options(utime, timeout, size, shards))
     {}
     
+    /*!
+        \brief Instantiate a cache.
+        
+        \param c the database, a mysql_client or another backend.
+        \param opt cache parameters.
+    */
+    db_cache(db_backend *c, const db_cache_options &opt);
+    
     ~db_cache();
     
+    //! Approximate memory used by the entries, in bytes.
+    size_t memory_usage();
+    
+    /*!
+        \brief Read the counters of the cache.
+        
+        Request threads update counters of their own stripe, reading them
+        sums all the stripes; the values are not taken at a single instant.
+    */
+    db_cache_stats stats();
+    
+    /*!
+        \brief Save the resident entries for a warm restart.
+        
+        Modified data is stored first, entries modified meanwhile are
+        marked and stored again after the restart. The file is replaced
+        atomically, the destructor saves one as well.
+        
+        The writers wait while the file is written. The next store
+        removes the file before it reaches the database, since the file
+        would then hold older data than the database.
+        
+        \param path defaults to db_cache_options::snapshot.
+    */
+    void snapshot(const std::string &path = std::string());
+    
     data_handle operator [] (const std::string &key)
     {
-        handle *h = locate(key);
+        return acquire(key, false);
+    }
+    
+    /*!
+        \brief Read only access to an entry.
+        
+        Many threads can hold the same entry with get_shared() at once,
+        operator [] waits for them. It does not mark the data as modified.
+    */
+    read_handle get_shared(const std::string &key)
+    {
+        return acquire(key, true);
+    }
+    
+    /*!
+        \brief Read the data through the L1 cache of the thread.
+        
+        With db_cache_options::l1_size set, each thread keeps snapshots of
+        the data it reads. A snapshot is returned while the stamp of its
+        key is unchanged, which costs one atomic load of shared memory.
+        A write through a data_handle, or an eviction, changes the stamp.
+        Otherwise the entry is read as get_shared() does.
+        
+        A snapshot is a copy owned by the thread. The L1 caches of a thread
+        are freed when it ends, or after their db_cache is destroyed by the
+        next get_value() of the thread. memory_usage() does not include
+        them.
+        
+        \return the data, which is never changed.
+    */
+    db_backend::value_ptr get_value(const std::string &key);
+    
+    /*!
+        \brief Lock many entries at once.
         
-        if (h == nullptr) {
-           h = add(key);
-        } else h -> lock(c_handle_timeout);
+        Missing entries are fetched with a single query. Entries are locked
+        in key order, so overlapping batches cannot deadlock.
         
-        return h;
+        \param keys duplicates are ignored.
+        \return a handle for each key, sorted by key, see data_handle::key().
+    */
+    std::vector<data_handle> get_many(std::vector<std::string> keys)
+    {
+        return acquire_many(std::move(keys), c_handle_timeout);
+    }
+    
+    /*!
+        \brief Lock related entries together, all of them or none.
+        
+        Like get_many(), entries are locked in key order: every group takes
+        them in the same order, so overlapping groups wait for each other
+        rather than deadlock and time out. If an entry cannot be locked in
+        time, the entries locked so far are released. Do not hold other
+        entries of the cache meanwhile, they are out of that order.
+        
+        \param keys duplicates are ignored.
+        \param timeout to lock all the entries, once the missing ones are
+        fetched.
+        \throw db_cache_timeout
+    */
+    data_group lock_many(std::vector<std::string> keys,
+        const std::chrono::milliseconds &timeout)
+    {
+        return data_group(acquire_many(std::move(keys), timeout));
     }
+    
+    data_group lock_many(std::vector<std::string> keys)
+    {
+        return lock_many(std::move(keys), c_handle_timeout);
+    }
+    
+    // receives the locked entry, or the error
+    typedef std::function<void(data_handle&&, std::exception_ptr)> callback;
+    
+    /*!
+        \brief Lock an entry without blocking the caller.
+        
+        A hit on an entry which is not locked completes within the caller,
+        otherwise the request is served by a thread of the fetch pool, see
+        db_cache_options::fetchers. Pool threads own their connections.
+        
+        \param done called with the locked entry or with the error,
+        either by the caller or by a pool thread; errors of the cache
+        always reach it, whichever thread serves the request. An
+        exception thrown by done in a pool thread is dropped.
+    */
+    void get_async(const std::string &key, callback done);
+    
+    std::future<data_handle> get_async(const std::string &key);
+    
+    /*!
+        \brief Load entries in the background.
+        
+        Rows are fetched in batches of db_cache_options::preload_batch and
+        inserted with one lock of each shard for a batch. Cached keys and
+        keys missing in the database are left alone; loading stops when
+        the cache is full. Batches are tasks of the fetch pool, without
+        a pool the caller loads all of them.
+        
+        \param keys duplicates are ignored.
+        \return the number of entries added.
+    */
+    std::future<size_t> preload(std::vector<std::string> keys);
+    
+    /*!
+        \brief Load a range of keys in the background, in key order.
+        
+        \param from first key.
+        \param to end of the range, not included; empty for no end.
+        \see preload(std::vector<std::string>)
+    */
+    std::future<size_t> preload(const std::string &from,
+        const std::string &to);
 };
 
 #endif
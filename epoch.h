@@ -0,0 +1,136 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Fabio Vaccari
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*!
+    \brief Epoch based reclamation for lock-free readers.
+    
+    A reader enters the current epoch before reading a shared structure
+    and leaves it afterwards. An object removed from the structure is
+    retired with the current epoch (see current()) and can be freed once
+    safe() says so: every reader which could have seen it has left.
+    
+    Readers count themselves in two counters, by epoch parity, spread over
+    stripes to keep threads apart. The epoch moves on only when the readers
+    of the previous one have left, so at most two epochs are active.
+    
+    try_advance() and safe() are for a single thread at a time.
+*/
+class epoch_domain
+{
+    static const size_t stripes = 16;
+    
+    struct stripe
+    {
+        std::atomic<long> e_readers[2];
+        char e_pad[64 - 2 * sizeof(std::atomic<long>)];
+    };
+    
+    std::atomic<uint64_t> e_epoch;
+    stripe e_stripes[stripes];
+    
+    static size_t stripe_index()
+    {
+        static std::atomic<size_t> next(0);
+        static thread_local size_t index = next++ % stripes;
+        return index;
+    }
+    
+public:
+    epoch_domain() : e_epoch(2)
+    {
+        for (stripe &s : e_stripes) {
+            s.e_readers[0] = 0;
+            s.e_readers[1] = 0;
+        }
+    }
+    
+    epoch_domain(const epoch_domain&) = delete;
+    epoch_domain& operator = (const epoch_domain&) = delete;
+    
+    // the reader is counted in the epoch it read last
+    uint64_t enter()
+    {
+        stripe &s = e_stripes[stripe_index()];
+        
+        for (;;) {
+            uint64_t e = e_epoch.load();
+            ++s.e_readers[e & 1];
+            if (e_epoch.load() == e) return e;
+            --s.e_readers[e & 1];
+        }
+    }
+    
+    void leave(uint64_t e)
+    {
+        --e_stripes[stripe_index()].e_readers[e & 1];
+    }
+    
+    uint64_t current() const
+    {
+        return e_epoch.load();
+    }
+    
+    // the counters of the previous epoch are reused by the next one
+    bool try_advance()
+    {
+        uint64_t e = e_epoch.load();
+        
+        for (stripe &s : e_stripes) {
+            if (s.e_readers[(e - 1) & 1].load() != 0) return false;
+        }
+        e_epoch.store(e + 1);
+        return true;
+    }
+    
+    // readers still in an epoch after the retired one entered after it
+    bool safe(uint64_t retired) const
+    {
+        return retired + 2 <= e_epoch.load();
+    }
+};
+
+// a reader within the scope
+class epoch_guard
+{
+    epoch_domain &g_domain;
+    const uint64_t g_epoch;
+    
+public:
+    explicit epoch_guard(epoch_domain &d) : g_domain(d), g_epoch(d.enter())
+    {}
+    
+    epoch_guard(const epoch_guard&) = delete;
+    epoch_guard& operator = (const epoch_guard&) = delete;
+    
+    ~epoch_guard() { g_domain.leave(g_epoch); }
+};
+
+#endif
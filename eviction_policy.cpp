@@ -0,0 +1,352 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Fabio Vaccari
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "eviction_policy.h"
+#include "db_cache.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+namespace {
+
+enum segment : unsigned char { window, probation, protect };
+
+// intrusive list of handles, front is the most recently used
+class handle_list
+{
+    handle *l_head;
+    handle *l_tail;
+    size_t l_size;
+    
+public:
+    handle_list() : l_head(), l_tail(), l_size(0) {}
+    
+    size_t size() const { return l_size; }
+    handle* back() const { return l_tail; }
+    
+    void push_front(handle *h)
+    {
+        h -> policy_prev = nullptr;
+        h -> policy_next = l_head;
+        if (l_head != nullptr) l_head -> policy_prev = h;
+        else l_tail = h;
+        l_head = h;
+        ++l_size;
+    }
+    
+    void remove(handle *h)
+    {
+        if (h -> policy_prev != nullptr) {
+            h -> policy_prev -> policy_next = h -> policy_next;
+        } else l_head = h -> policy_next;
+        
+        if (h -> policy_next != nullptr) {
+            h -> policy_next -> policy_prev = h -> policy_prev;
+        } else l_tail = h -> policy_prev;
+        
+        h -> policy_prev = h -> policy_next = nullptr;
+        --l_size;
+    }
+    
+    void move_to_front(handle *h)
+    {
+        remove(h);
+        push_front(h);
+    }
+};
+
+// FIFO with a second chance for touched entries, equivalent to CLOCK
+class clock_policy : public eviction_policy
+{
+    handle_list p_list;
+    
+public:
+    
+    void inserted(handle *h) override { p_list.push_front(h); }
+    void erased(handle *h) override { p_list.remove(h); }
+    void retained(handle *h) override { p_list.move_to_front(h); }
+    
+    handle* victim(size_t steps) override
+    {
+        // after a full round every entry is untouched
+        for (size_t n = p_list.size(); n > 0; --n) {
+            if (steps-- == 0) return nullptr;
+            handle *h = p_list.back();
+            if ( ! h -> set_touched(false)) return h;
+            p_list.move_to_front(h);
+        }
+        return p_list.back();
+    }
+};
+
+// probation and protected segments, an entry touched while in probation
+// is promoted when it reaches the end of the segment;
+// protected entries in excess are moved back in probation
+class segmented_lru
+{
+    handle_list s_probation;
+    handle_list s_protected;
+    
+    handle_list& list_of(handle *h)
+    {
+        return h -> policy_segment == protect ? s_protected : s_probation;
+    }
+    
+    // protected segment holds up to 80% of the entries, the rest
+    // is moved by the next calls once the steps are used
+    void rebalance(size_t &steps)
+    {
+        size_t max_protected = (size() * 4) / 5;
+        
+        for (size_t n = s_protected.size(); n > 0 && steps > 0
+                && s_protected.size() > max_protected; --n, --steps) {
+            handle *h = s_protected.back();
+            
+            if (h -> set_touched(false)) {
+                s_protected.move_to_front(h);
+            } else {
+                s_protected.remove(h);
+                h -> policy_segment = probation;
+                s_probation.push_front(h);
+            }
+        }
+    }
+    
+public:
+    
+    size_t size() const { return s_probation.size() + s_protected.size(); }
+    
+    void insert(handle *h)
+    {
+        h -> policy_segment = probation;
+        s_probation.push_front(h);
+    }
+    
+    void remove(handle *h) { list_of(h).remove(h); }
+    void retain(handle *h) { list_of(h).move_to_front(h); }
+    
+    handle* victim(size_t &steps)
+    {
+        for (size_t n = 2 * size(); n > 0; --n) {
+            if (steps == 0) return nullptr;
+            --steps;
+            rebalance(steps);
+            
+            handle *h = s_probation.back();
+            
+            if (h == nullptr) {
+                h = s_protected.back();
+                if (h == nullptr) return nullptr;
+                s_protected.remove(h);
+                h -> policy_segment = probation;
+                s_probation.push_front(h);
+                continue;
+            }
+            
+            if ( ! h -> set_touched(false)) return h;
+            
+            s_probation.remove(h);
+            h -> policy_segment = protect;
+            s_protected.push_front(h);
+        }
+        return s_probation.size() != 0 ? s_probation.back()
+                                       : s_protected.back();
+    }
+};
+
+class slru_policy : public eviction_policy
+{
+    segmented_lru p_main;
+    
+public:
+    
+    void inserted(handle *h) override { p_main.insert(h); }
+    void erased(handle *h) override { p_main.remove(h); }
+    void retained(handle *h) override { p_main.retain(h); }
+    handle* victim(size_t steps) override { return p_main.victim(steps); }
+};
+
+// count-min sketch with 4 bit saturating counters, halved periodically
+// counters are updated by many readers at the same time, increments
+// can be lost but the estimate stays approximate anyway
+class frequency_sketch
+{
+    std::unique_ptr<std::atomic<unsigned char>[]> f_table;
+    size_t f_mask;
+    std::atomic<size_t> f_additions;
+    const size_t f_sample;
+    
+    size_t index(size_t hash, unsigned i) const
+    {
+        static const uint64_t seed[] = {
+            0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+            0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL
+        };
+        uint64_t x = (uint64_t(hash) + seed[i]) * 0x9e3779b97f4a7c15ULL;
+        return size_t(x ^ (x >> 32)) & f_mask;
+    }
+    
+public:
+    
+    explicit frequency_sketch(size_t capacity) :
+        f_additions(0), f_sample(10 * std::max<size_t>(capacity, 64))
+    {
+        size_t size = 64;
+        while (size < 4 * capacity && size < (size_t(1) << 26)) size <<= 1;
+        f_table.reset(new std::atomic<unsigned char>[size]());
+        f_mask = size - 1;
+    }
+    
+    void increment(size_t hash)
+    {
+        for (unsigned i = 0; i < 4; ++i) {
+            std::atomic<unsigned char> &c = f_table[index(hash, i)];
+            unsigned char v = c.load(std::memory_order_relaxed);
+            if (v < 15) c.store(v + 1, std::memory_order_relaxed);
+        }
+        f_additions.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    unsigned estimate(size_t hash) const
+    {
+        unsigned f = 15;
+        for (unsigned i = 0; i < 4; ++i) {
+            unsigned v = f_table[index(hash, i)].load(
+                std::memory_order_relaxed);
+            f = std::min(f, v);
+        }
+        return f;
+    }
+    
+    // forget old history, called with the shard locked for writing
+    void age()
+    {
+        if (f_additions.load(std::memory_order_relaxed) < f_sample) return;
+        
+        for (size_t i = 0; i <= f_mask; ++i) {
+            unsigned char v = f_table[i].load(std::memory_order_relaxed);
+            f_table[i].store(v >> 1, std::memory_order_relaxed);
+        }
+        f_additions.store(0, std::memory_order_relaxed);
+    }
+};
+
+// new entries enter a small LRU window; when evicting, the window
+// candidate is admitted in the main segmented LRU only if it is more
+// frequent than the main victim, otherwise it is the victim itself
+class tinylfu_policy : public eviction_policy
+{
+    handle_list p_window;
+    segmented_lru p_main;
+    frequency_sketch p_sketch;
+    
+    // the window holds 1% of the entries
+    size_t max_window() const
+    {
+        return std::max<size_t>(1, (p_window.size() + p_main.size()) / 100);
+    }
+    
+public:
+    
+    explicit tinylfu_policy(size_t capacity) : p_sketch(capacity) {}
+    
+    void inserted(handle *h) override
+    {
+        p_sketch.age();
+        p_sketch.increment(h -> hash);
+        
+        h -> policy_segment = window;
+        p_window.push_front(h);
+        
+        // no admission filter while nothing is evicted
+        while (p_window.size() > max_window()) {
+            handle *w = p_window.back();
+            p_window.remove(w);
+            p_main.insert(w);
+        }
+    }
+    
+    void erased(handle *h) override
+    {
+        if (h -> policy_segment == window) p_window.remove(h);
+        else p_main.remove(h);
+    }
+    
+    void retained(handle *h) override
+    {
+        if (h -> policy_segment == window) p_window.move_to_front(h);
+        else p_main.retain(h);
+    }
+    
+    void accessed(handle *h) override
+    {
+        p_sketch.increment(h -> hash);
+    }
+    
+    handle* victim(size_t steps) override
+    {
+        handle *candidate = nullptr;
+        size_t n = p_window.size();
+        
+        for (; n > 0 && steps > 0; --n, --steps) {
+            handle *w = p_window.back();
+            if ( ! w -> set_touched(false)) {
+                candidate = w;
+                break;
+            }
+            p_window.move_to_front(w);
+        }
+        if (n == 0) candidate = p_window.back();
+        
+        handle *v = p_main.victim(steps);
+        
+        // the admission needs both, unless the main segment is empty
+        if (candidate == nullptr) return v;
+        if (v == nullptr) return p_main.size() == 0 ? candidate : nullptr;
+        
+        if (p_sketch.estimate(candidate -> hash)
+                > p_sketch.estimate(v -> hash)) {
+            p_window.remove(candidate);
+            p_main.insert(candidate);
+            return v;
+        }
+        return candidate;
+    }
+};
+
+} // namespace
+
+std::unique_ptr<eviction_policy> make_eviction_policy(eviction kind,
+    size_t capacity)
+{
+    switch (kind) {
+    case eviction::slru:
+        return std::unique_ptr<eviction_policy>(new slru_policy);
+    case eviction::tinylfu:
+        return std::unique_ptr<eviction_policy>(new tinylfu_policy(capacity));
+    case eviction::clock:
+    default:
+        return std::unique_ptr<eviction_policy>(new clock_policy);
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef EVICTION_POLICY_H
+#define EVICTION_POLICY_H
+
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Fabio Vaccari
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cstddef>
+#include <memory>
+
+class handle;
+
+enum class eviction
+{
+    clock,   // second chance on the touched flag
+    slru,    // segmented LRU, probation and protected segments
+    tinylfu  // W-TinyLFU, window LRU and frequency based admission
+};
+
+/*!
+    \brief Choose the entries to remove from a cache shard.
+    
+    There is one policy for each shard. The policy links the entries
+    through the hooks in 'handle'.
+    
+    All the methods but accessed() are called with the shard locked for
+    writing. accessed() is called by many readers at the same time, it can
+    only use the touched flag and atomic variables.
+*/
+class eviction_policy
+{
+public:
+    virtual ~eviction_policy() {}
+    
+    // a new entry
+    virtual void inserted(handle *h) = 0;
+    
+    // an entry removed from the shard
+    virtual void erased(handle *h) = 0;
+    
+    // an entry found by a reader
+    virtual void accessed(handle *) {}
+    
+    // next entry to remove, looking at about 'steps' entries at most;
+    // nullptr if the shard is empty or none was found in the steps,
+    // the next call goes on from there
+    // it stays in the policy until erased() or retained()
+    virtual handle* victim(size_t steps) = 0;
+    
+    // the victim cannot be removed now, i.e. it is locked or dirty
+    virtual void retained(handle *h) = 0;
+};
+
+/*!
+    \brief Create a policy.
+    
+    \param kind policy type.
+    \param capacity expected number of entries in the shard.
+*/
+std::unique_ptr<eviction_policy> make_eviction_policy(eviction kind,
+    size_t capacity);
+
+#endif
@@ -0,0 +1,186 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Fabio Vaccari
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "handle_table.h"
+#include "db_cache.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+const size_t min_slots = 16;
+
+// removed entries, the probe goes on past them
+char removed;
+
+}
+
+handle* handle_table::tombstone()
+{
+    return reinterpret_cast<handle*>(&removed);
+}
+
+handle_table::handle_table(epoch_domain &epochs) :
+    t_epochs(epochs), t_slots(nullptr), t_owner(new slots(min_slots)),
+    t_size(0), t_used(0)
+{
+    t_slots = t_owner.get();
+}
+
+// the low bits of the hash select the shard, the product mixes all of them
+size_t handle_table::first(size_t hash, size_t mask)
+{
+    return size_t((uint64_t(hash) * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+}
+
+// the slot of a published handle does not change
+bool handle_table::match(const slot &sl, const std::string &key,
+    uint16_t t, handle *h)
+{
+    if (sl.sl_tag != t) return false;
+    
+    if (key.size() <= inline_key) {
+        return sl.sl_size == key.size()
+            && std::memcmp(sl.sl_key, key.data(), key.size()) == 0;
+    }
+    return sl.sl_size > inline_key && h -> key == key;
+}
+
+handle* handle_table::find(const std::string &key, size_t hash) const
+{
+    const slots &a = *t_slots.load(std::memory_order_acquire);
+    uint16_t t = tag(hash);
+    
+    for (size_t n = first(hash, a.ss_mask); ; n = (n + 1) & a.ss_mask) {
+        const slot &sl = a.ss_slot[n];
+        handle *h = sl.sl_handle.load(std::memory_order_acquire);
+        
+        if (h == nullptr) return nullptr;
+        if (h != tombstone() && match(sl, key, t, h)) return h;
+    }
+}
+
+// the table is rebuilt when entries and tombstones fill 7/8 of the slots,
+// sized for twice the entries
+void handle_table::insert(handle *h)
+{
+    if ((t_used + 1) * 8 > (t_owner -> ss_mask + 1) * 7) {
+        size_t n = min_slots;
+        while (n * 7 < (t_size + 1) * 16) n <<= 1;
+        rebuild(n);
+    }
+    
+    place(*t_owner, h);
+    ++t_size;
+    ++t_used;
+}
+
+// a tombstone is never reused, a reader may still compare its slot
+void handle_table::erase(handle *h)
+{
+    slots &a = *t_owner;
+    
+    for (size_t n = first(h -> hash, a.ss_mask); ; n = (n + 1) & a.ss_mask) {
+        slot &sl = a.ss_slot[n];
+        handle *p = sl.sl_handle.load(std::memory_order_relaxed);
+        
+        if (p == nullptr) return;
+        if (p == h) {
+            sl.sl_handle.store(tombstone(), std::memory_order_release);
+            --t_size;
+            return;
+        }
+    }
+}
+
+void handle_table::reclaim()
+{
+    auto i = t_retired.begin();
+    while (i != t_retired.end() && t_epochs.safe(i -> first)) ++i;
+    t_retired.erase(t_retired.begin(), i);
+}
+
+void handle_table::place(slots &a, handle *h)
+{
+    size_t n = first(h -> hash, a.ss_mask);
+    
+    while (a.ss_slot[n].sl_handle.load(std::memory_order_relaxed) != nullptr) {
+        n = (n + 1) & a.ss_mask;
+    }
+    
+    slot &sl = a.ss_slot[n];
+    sl.sl_tag = tag(h -> hash);
+    sl.sl_size = uint8_t(std::min<size_t>(h -> key.size(), 255));
+    if (h -> key.size() <= inline_key) {
+        std::memcpy(sl.sl_key, h -> key.data(), h -> key.size());
+    }
+    sl.sl_handle.store(h, std::memory_order_release);
+}
+
+// readers may still probe the old table, it is retired
+void handle_table::rebuild(size_t n)
+{
+    std::unique_ptr<slots> fresh(new slots(n));
+    
+    for_each([&fresh] (handle *h) {
+        place(*fresh, h);
+    });
+    
+    t_retired.reserve(t_retired.size() + 1);
+    t_slots.store(fresh.get(), std::memory_order_release);
+    t_retired.emplace_back(t_epochs.current(), std::move(t_owner));
+    t_owner = std::move(fresh);
+    t_used = t_size;
+    reclaim();
+}
+
+// blocks of a new chunk are linked in address order
+void* handle_slab::allocate()
+{
+    static_assert(alignof(handle) <= alignof(std::max_align_t),
+        "handle_slab: chunks are not aligned for handle");
+    
+    if (a_free == nullptr) {
+        std::unique_ptr<char[]> fresh(new char[sizeof(handle) * chunk_size]);
+        char *chunk = fresh.get();
+        a_chunks.push_back(std::move(fresh));
+        
+        for (size_t n = chunk_size; n-- > 0; ) {
+            block *b = reinterpret_cast<block*>(chunk + n * sizeof(handle));
+            b -> b_next = a_free;
+            a_free = b;
+        }
+    }
+    
+    block *b = a_free;
+    a_free = b -> b_next;
+    return b;
+}
+
+void handle_slab::deallocate(void *p)
+{
+    block *b = static_cast<block*>(p);
+    b -> b_next = a_free;
+    a_free = b;
+}
@@ -0,0 +1,151 @@
+#ifndef HANDLE_TABLE_H
+#define HANDLE_TABLE_H
+
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Fabio Vaccari
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "epoch.h"
+
+class handle;
+
+/*!
+    \brief Index of the entries of a cache shard.
+    
+    Open addressing with linear probing over 32 byte slots. A slot keeps
+    a fingerprint of the hash and, up to inline_key bytes, the key itself,
+    so a lookup reads the handle only for the match. Removed entries leave
+    a tombstone, slots are reused when the table is rebuilt.
+    
+    find() runs without locking within an epoch of the table domain (see
+    epoch_guard): a slot is filled before its handle is published and a
+    rebuilt table replaces the old one, which is retired. The other methods
+    are called with the shard locked for writing.
+*/
+class handle_table
+{
+public:
+    static const size_t inline_key = 21;
+    
+    explicit handle_table(epoch_domain &epochs);
+    
+    handle_table(const handle_table&) = delete;
+    handle_table& operator = (const handle_table&) = delete;
+    
+    size_t size() const { return t_size; }
+    
+    // nullptr if the key is not in the table; the handle may have been
+    // erased meanwhile, it is valid until the reader leaves the epoch
+    handle* find(const std::string &key, size_t hash) const;
+    
+    // the key of h must not be in the table
+    void insert(handle *h);
+    
+    void erase(handle *h);
+    
+    // free the retired tables no reader can see
+    void reclaim();
+    
+    template <typename F>
+    void for_each(F f) const
+    {
+        const slots &a = *t_slots.load();
+        
+        for (size_t n = 0; n <= a.ss_mask; ++n) {
+            handle *h = a.ss_slot[n].sl_handle.load();
+            if (h != nullptr && h != tombstone()) f(h);
+        }
+    }
+    
+private:
+    
+    struct slot
+    {
+        std::atomic<handle*> sl_handle; // nullptr for a free slot
+        uint16_t sl_tag; // hash bits
+        uint8_t sl_size; // key size, the key is inline up to inline_key
+        char sl_key[inline_key];
+    };
+    
+    struct slots
+    {
+        const size_t ss_mask; // number of slots - 1, a power of two - 1
+        std::unique_ptr<slot[]> ss_slot;
+        
+        explicit slots(size_t n) : ss_mask(n - 1), ss_slot(new slot[n]()) {}
+    };
+    
+    epoch_domain &t_epochs;
+    std::atomic<slots*> t_slots;
+    std::unique_ptr<slots> t_owner; // owns t_slots
+    std::vector<std::pair<uint64_t, std::unique_ptr<slots>>> t_retired;
+    size_t t_size; // entries
+    size_t t_used; // entries and tombstones
+    
+    static handle* tombstone();
+    
+    static uint16_t tag(size_t hash) { return uint16_t(hash >> 32); }
+    
+    static size_t first(size_t hash, size_t mask);
+    static bool match(const slot &sl, const std::string &key, uint16_t t,
+        handle *h);
+    static void place(slots &a, handle *h);
+    void rebuild(size_t n);
+};
+
+/*!
+    \brief Memory for the handles of a cache shard.
+    
+    Handles are carved from chunks of chunk_size blocks; a freed block
+    is reused by the next allocation, chunks are released with the slab.
+    
+    Not thread safe, the shard lock protects it.
+*/
+class handle_slab
+{
+    struct block { block *b_next; };
+    
+    std::vector<std::unique_ptr<char[]>> a_chunks;
+    block *a_free;
+    
+public:
+    static const size_t chunk_size = 256;
+    
+    handle_slab() : a_free(nullptr) {}
+    
+    handle_slab(const handle_slab&) = delete;
+    handle_slab& operator = (const handle_slab&) = delete;
+    
+    // raw memory for one handle
+    void* allocate();
+    void deallocate(void *p);
+};
+
+#endif
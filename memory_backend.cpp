@@ -0,0 +1,185 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Fabio Vaccari
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "memory_backend.h"
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+memory_backend::memory_backend(const memory_backend_options &opt) :
+    mb_options(opt), mb_shards(new shard[std::max(opt.shards, 1u)]),
+    mb_fetches(0), mb_stores(0)
+{}
+
+static const std::string& data_of(const db_backend::record &r)
+{
+    return std::get<1>(r);
+}
+
+static const std::string& data_of(const db_backend::shared_record &r)
+{
+    return *std::get<1>(r);
+}
+
+size_t memory_backend::index_of(const std::string &key) const
+{
+    return std::hash<std::string>()(key) % std::max(mb_options.shards, 1u);
+}
+
+memory_backend::shard& memory_backend::shard_of(const std::string &key)
+{
+    return mb_shards[index_of(key)];
+}
+
+std::string memory_backend::fetch(const std::string &key)
+{
+    ++mb_fetches;
+    std::this_thread::sleep_for(mb_options.fetch_latency);
+    
+    shard &s = shard_of(key);
+    std::lock_guard<std::mutex> lk(s.mb_guard);
+    auto i = s.mb_table.find(key);
+    return i != s.mb_table.end() ? i -> second : std::string();
+}
+
+std::vector<db_backend::record> memory_backend::fetch_many(
+    const std::vector<std::string> &keys)
+{
+    ++mb_fetches;
+    std::this_thread::sleep_for(mb_options.fetch_latency);
+    
+    std::vector<record> list;
+    
+    for (auto &key : keys) {
+        shard &s = shard_of(key);
+        std::lock_guard<std::mutex> lk(s.mb_guard);
+        auto i = s.mb_table.find(key);
+        if (i != s.mb_table.end()) list.emplace_back(key, i -> second);
+    }
+    return list;
+}
+
+// every map gives its first records of the range, the first of all of
+// them are the page
+std::vector<db_backend::record> memory_backend::fetch_range(
+    const std::string &from, const std::string &to, size_t limit, bool next)
+{
+    ++mb_fetches;
+    std::this_thread::sleep_for(mb_options.fetch_latency);
+    
+    std::vector<record> list;
+    
+    for (unsigned n = 0; n < std::max(mb_options.shards, 1u); ++n) {
+        shard &s = mb_shards[n];
+        std::lock_guard<std::mutex> lk(s.mb_guard);
+        auto i = next ? s.mb_table.upper_bound(from)
+                      : s.mb_table.lower_bound(from);
+        
+        for (size_t k = 0; k < limit && i != s.mb_table.end()
+                && (to.empty() || i -> first < to); ++k, ++i) {
+            list.emplace_back(i -> first, i -> second);
+        }
+    }
+    
+    std::sort(list.begin(), list.end());
+    if (list.size() > limit) list.resize(limit);
+    return list;
+}
+
+void memory_backend::store(const std::string &key, const std::string &data)
+{
+    ++mb_stores;
+    std::this_thread::sleep_for(mb_options.store_latency);
+    
+    shard &s = shard_of(key);
+    std::lock_guard<std::mutex> lk(s.mb_guard);
+    s.mb_table[key] = data;
+}
+
+// all of the batch or none: the maps are locked in order, then the data
+// is copied and the missing keys inserted before a value changes, a
+// failure erases the inserted keys; the values are swapped in at the end
+template <class R>
+void memory_backend::store_records(const std::vector<R> &list)
+{
+    ++mb_stores;
+    std::this_thread::sleep_for(mb_options.store_latency);
+    
+    typedef std::map<std::string, std::string>::iterator slot;
+    std::vector<std::string> data;
+    std::vector<size_t> used;
+    std::vector<slot> slots;
+    std::vector<std::pair<shard*, slot>> inserted;
+    data.reserve(list.size());
+    used.reserve(list.size());
+    slots.reserve(list.size());
+    inserted.reserve(list.size());
+    
+    for (auto &r : list) {
+        data.push_back(data_of(r));
+        used.push_back(index_of(std::get<0>(r)));
+    }
+    std::sort(used.begin(), used.end());
+    used.erase(std::unique(used.begin(), used.end()), used.end());
+    
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(used.size());
+    for (size_t n : used) locks.emplace_back(mb_shards[n].mb_guard);
+    
+    try {
+        for (auto &r : list) {
+            shard &s = shard_of(std::get<0>(r));
+            auto i = s.mb_table.emplace(std::get<0>(r), std::string());
+            if (i.second) inserted.emplace_back(&s, i.first);
+            slots.push_back(i.first);
+        }
+    } catch (...) {
+        for (auto &i : inserted) i.first -> mb_table.erase(i.second);
+        throw;
+    }
+    
+    // a key stored twice keeps the last data
+    for (size_t n = 0; n < slots.size(); ++n) slots[n] -> second.swap(data[n]);
+}
+
+void memory_backend::store(const std::vector<record> &list)
+{
+    store_records(list);
+}
+
+void memory_backend::store(const std::vector<shared_record> &list)
+{
+    store_records(list);
+}
+
+size_t memory_backend::size()
+{
+    size_t n = 0;
+    
+    for (unsigned k = 0; k < std::max(mb_options.shards, 1u); ++k) {
+        std::lock_guard<std::mutex> lk(mb_shards[k].mb_guard);
+        n += mb_shards[k].mb_table.size();
+    }
+    return n;
+}
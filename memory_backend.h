@@ -0,0 +1,101 @@
+#ifndef MEMORY_BACKEND_H
+#define MEMORY_BACKEND_H
+
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Fabio Vaccari
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "db_backend.h"
+
+// in-memory backend parameters
+struct memory_backend_options
+{
+    std::chrono::microseconds fetch_latency; // added to each fetch call
+    std::chrono::microseconds store_latency; // added to each store call
+    unsigned shards; // independently locked maps
+    
+    memory_backend_options() :
+        fetch_latency(0), store_latency(0), shards(16)
+    {}
+};
+
+/*!
+    \brief A table in process memory, for tests and benchmarks.
+    
+    A call sleeps for the configured latency, as a thread waiting for
+    the database does, then reads or writes the table. The table is split
+    in maps by key hash, each one with its own lock; store(list) locks
+    the maps of the batch, a reader sees all of it or none.
+*/
+class memory_backend : public db_backend
+{
+    struct shard
+    {
+        std::mutex mb_guard;
+        std::map<std::string, std::string> mb_table;
+    };
+    
+    const memory_backend_options mb_options;
+    std::unique_ptr<shard[]> mb_shards;
+    std::atomic<uint64_t> mb_fetches;
+    std::atomic<uint64_t> mb_stores;
+    
+    size_t index_of(const std::string &key) const;
+    shard& shard_of(const std::string &key);
+    
+    template <class R>
+    void store_records(const std::vector<R> &list);
+    
+public:
+    
+    explicit memory_backend(
+        const memory_backend_options &opt = memory_backend_options());
+    
+    std::string fetch(const std::string &key) override;
+    std::vector<record> fetch_many(const std::vector<std::string> &keys)
+        override;
+    std::vector<record> fetch_range(const std::string &from,
+        const std::string &to, size_t limit, bool next = false) override;
+    void store(const std::string &key, const std::string &data) override;
+    void store(const std::vector<record> &list) override;
+    void store(const std::vector<shared_record> &list) override;
+    void thread_init() override {}
+    void thread_end() override {}
+    
+    //! Calls of the fetch and the store methods.
+    uint64_t fetch_calls() const { return mb_fetches; }
+    uint64_t store_calls() const { return mb_stores; }
+    
+    //! Records in the table.
+    size_t size();
+};
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Fabio Vaccari
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/*!
+    \brief Counters for statistics, cheap to update.
+    
+    Values are kept in stripes, one for each group of threads, each one on
+    its own cache lines; a thread updates its stripe with relaxed atomic
+    operations and a reader sums the stripes. A snapshot is not atomic as
+    a whole, counters read at the same time may differ by a few events.
+*/
+
+static const size_t stat_stripes = 16;
+
+// the stripe of the calling thread
+inline size_t stat_stripe()
+{
+    static std::atomic<size_t> next(0);
+    static thread_local size_t index = next++ % stat_stripes;
+    return index;
+}
+
+class stat_counter
+{
+    std::atomic<uint64_t> sc_value;
+    
+public:
+    stat_counter() : sc_value(0) {}
+    
+    void add(uint64_t n = 1)
+    {
+        sc_value.fetch_add(n, std::memory_order_relaxed);
+    }
+    
+    uint64_t get() const
+    {
+        return sc_value.load(std::memory_order_relaxed);
+    }
+};
+
+// latencies by powers of two of nanoseconds: bucket n counts the values
+// below 2^n and not below 2^(n-1), the last one the longer ones
+struct latency_stats
+{
+    static const size_t buckets = 40;
+    
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t bucket[buckets];
+    
+    latency_stats() : count(0), total_ns(0), bucket() {}
+    
+    double mean_ns() const
+    {
+        return count != 0 ? double(total_ns) / count : 0;
+    }
+    
+    //! The upper bound of the bucket holding the given percentile.
+    uint64_t percentile_ns(double p) const
+    {
+        uint64_t rank = uint64_t(p / 100 * count), seen = 0;
+        
+        for (size_t n = 0; n < buckets; ++n) {
+            seen += bucket[n];
+            if (seen > rank) return uint64_t(1) << n;
+        }
+        return count != 0 ? uint64_t(1) << (buckets - 1) : 0;
+    }
+    
+    latency_stats& operator += (const latency_stats &l)
+    {
+        count += l.count;
+        total_ns += l.total_ns;
+        for (size_t n = 0; n < buckets; ++n) bucket[n] += l.bucket[n];
+        return *this;
+    }
+};
+
+class stat_latency
+{
+    stat_counter sl_total_ns;
+    stat_counter sl_bucket[latency_stats::buckets];
+    
+public:
+    
+    typedef std::chrono::steady_clock::time_point time_point;
+    
+    void add(std::chrono::nanoseconds elapsed)
+    {
+        uint64_t ns = elapsed.count() > 0 ? elapsed.count() : 0;
+        size_t n = ns != 0 ? 64 - __builtin_clzll(ns) : 0;
+        
+        if (n >= latency_stats::buckets) n = latency_stats::buckets - 1;
+        sl_bucket[n].add();
+        sl_total_ns.add(ns);
+    }
+    
+    // from start to now
+    void add_since(const time_point &start)
+    {
+        add(std::chrono::steady_clock::now() - start);
+    }
+    
+    void read(latency_stats &l) const
+    {
+        l.total_ns += sl_total_ns.get();
+        
+        for (size_t n = 0; n < latency_stats::buckets; ++n) {
+            uint64_t c = sl_bucket[n].get();
+            l.bucket[n] += c;
+            l.count += c;
+        }
+    }
+};
+
+// a copy of T for each stripe, T is a structure of counters
+template <typename T>
+class striped
+{
+    struct cell
+    {
+        T c_value;
+        char c_pad[64]; // no cache line is shared by two stripes
+    };
+    
+    cell s_cells[stat_stripes];
+    
+public:
+    
+    T& local()
+    {
+        return s_cells[stat_stripe()].c_value;
+    }
+    
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (const cell &c : s_cells) f(c.c_value);
+    }
+};
+
+#endif
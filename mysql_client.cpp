@@ -25,16 +25,88 @@ THE SOFTWARE.
 #include "mysql_client.h"
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
 #include <cppconn/driver.h>
+#include <condition_variable>
 #include <cppconn/prepared_statement.h>
+#include <exception>
+#include <istream>
+#include <map>
 #include <mutex>
 #include <mysql/mysql.h>
+#include <streambuf>
 #include <thread>
 
 // note. shared pointers are handled by the driver
 using statement = std::unique_ptr<sql::PreparedStatement>;
 using result_set = std::unique_ptr<sql::ResultSet>;
 
+static const char *fetch_query = R"mysql(
+    SELECT     `data`
+    FROM `records`
+    WHERE `key` = ?
+)mysql";
+
+static const char *fetch_many_query = R"mysql(
+    SELECT     `key`, `data`
+    FROM `records`
+    WHERE `key` IN (?)mysql";
+
+// keyset pagination, the next page starts after the last key read;
+// an empty end key means no end
+static const char *fetch_range_first = R"mysql(
+    SELECT     `key`, `data`
+    FROM `records`
+    WHERE `key` >= ? AND (? = '' OR `key` < ?)
+    ORDER BY `key`
+    LIMIT ?
+)mysql";
+
+static const char *fetch_range_next = R"mysql(
+    SELECT     `key`, `data`
+    FROM `records`
+    WHERE `key` > ? AND (? = '' OR `key` < ?)
+    ORDER BY `key`
+    LIMIT ?
+)mysql";
+
+static const char *store_query = R"mysql(
+    INSERT INTO `records`
+    SET  `key` = ?, `data` = ?
+    ON DUPLICATE KEY UPDATE `data` = ?
+)mysql";
+
+static const char *store_many_query = R"mysql(
+    INSERT INTO `records` (`key`, `data`)
+    VALUES (?, ?))mysql";
+
+static const char *store_many_update = R"mysql(
+    ON DUPLICATE KEY UPDATE `data` = VALUES(`data`)
+)mysql";
+
+static const std::string& data_of(const db_backend::record &r)
+{
+    return std::get<1>(r);
+}
+
+static const std::string& data_of(const db_backend::shared_record &r)
+{
+    return *std::get<1>(r);
+}
+
+// reads data in place, the driver sends it in chunks
+class data_stream : private std::streambuf, public std::istream
+{
+public:
+    
+    explicit data_stream(const std::string &data) : std::istream(this)
+    {
+        char *p = const_cast<char*>(data.data());
+        setg(p, p, p + data.size());
+    }
+};
+
 class mysql_client::mysql_connection_handler
 {
     std::string mc_host;
@@ -44,81 +116,265 @@ class mysql_client::mysql_connection_handler
     // MySQL driver
     sql::Driver *mc_driver;
     
-    typedef std::tuple<std::thread::id, sql::Connection*> conn_entry;
-    std::vector<conn_entry> mc_conn_list;
+public:
+    
+    struct counters
+    {
+        stat_latency m_fetch;
+        stat_counter m_fetch_rows;
+        stat_latency m_store;
+        stat_counter m_store_rows;
+        stat_counter m_errors;
+        stat_counter m_connects, m_disconnects;
+    };
+    
+    striped<counters> mc_stats;
+    
+    // times a call, one which throws is counted as an error
+    class timed_call
+    {
+        stat_latency &tc_latency;
+        stat_counter &tc_errors;
+        const std::chrono::steady_clock::time_point tc_start;
+        
+    public:
+        timed_call(stat_latency &l, stat_counter &e) :
+            tc_latency(l), tc_errors(e),
+            tc_start(std::chrono::steady_clock::now())
+        {}
+        
+        ~timed_call()
+        {
+            if (std::uncaught_exception()) tc_errors.add();
+            else tc_latency.add_since(tc_start);
+        }
+    };
+    
+    // a connection and its prepared statements,
+    // statements are prepared once and dropped with the connection
+    struct conn_entry
+    {
+        std::thread::id ce_thread;
+        std::unique_ptr<sql::Connection> ce_conn;
+        statement ce_fetch;
+        statement ce_store;
+        std::map<size_t, statement> ce_fetch_many; // by number of keys
+        std::map<size_t, statement> ce_store_many; // by number of rows
+        statement ce_range_first;
+        statement ce_range_next;
+        
+        explicit conn_entry(std::thread::id id) : ce_thread(id) {}
+        
+        ~conn_entry() { close(); }
+        
+        sql::PreparedStatement* prepare(statement &pstmt,
+            const std::string &q)
+        {
+            if ( ! pstmt) pstmt.reset(ce_conn -> prepareStatement(q));
+            return pstmt.get();
+        }
+        
+        // statements go before their connection
+        void close()
+        {
+            ce_range_next.reset();
+            ce_range_first.reset();
+            ce_store_many.clear();
+            ce_fetch_many.clear();
+            ce_store.reset();
+            ce_fetch.reset();
+            ce_conn.reset();
+        }
+    };
+    
+    // a connection borrowed for one operation,
+    // pooled connections go back to the pool on destruction
+    class lease
+    {
+        mysql_connection_handler *l_handler;
+        conn_entry *l_entry;
+        
+    public:
+        lease(mysql_connection_handler *h, conn_entry *e) :
+            l_handler(h), l_entry(e)
+        {}
+        
+        lease(lease &&l) : l_handler(l.l_handler), l_entry(l.l_entry)
+        {
+            l.l_handler = nullptr;
+        }
+        
+        lease(const lease&) = delete;
+        
+        ~lease()
+        {
+            if (l_handler != nullptr) l_handler -> give_back(l_entry);
+        }
+        
+        conn_entry* operator -> () { return l_entry; }
+        conn_entry& operator * () { return *l_entry; }
+    };
+    
+private:
+    
+    // threads own a connection each, found without locking through
+    // mc_local; in pool mode they borrow one of mc_pool_size connections
+    std::vector<std::unique_ptr<conn_entry>> mc_conn_list;
     std::mutex mc_guard;
     
+    struct local_entry
+    {
+        const mysql_connection_handler *le_owner;
+        conn_entry *le_entry;
+    };
+    
+    static thread_local local_entry mc_local;
+    
+    const size_t mc_pool_size; // 0 if not in pool mode
+    std::vector<conn_entry*> mc_pool_free;
+    std::condition_variable mc_pool_ready;
+    
+    void connect(conn_entry &e);
+    void give_back(conn_entry *e);
+    
 public:
     mysql_connection_handler(const std::string &url,
-        const std::string usr, const std::string &pwd);
+        const std::string usr, const std::string &pwd, size_t pool_size);
     
     ~mysql_connection_handler();
     
-    sql::Connection* get_connection();
+    bool pooled() const { return mc_pool_size != 0; }
+    
+    lease get_connection();
     void close_connection();
 };
 
+thread_local mysql_client::mysql_connection_handler::local_entry
+mysql_client::mysql_connection_handler::mc_local = { nullptr, nullptr };
+
 mysql_client::mysql_connection_handler::mysql_connection_handler(
-    const std::string &url, const std::string usr, const std::string &pwd
-    ) : mc_host(url), mc_user(usr), mc_password(pwd)
+    const std::string &url, const std::string usr, const std::string &pwd,
+    size_t pool_size
+    ) : mc_host(url), mc_user(usr), mc_password(pwd), mc_pool_size(pool_size)
 {
     mc_driver = get_driver_instance();
 }
 
 mysql_client::mysql_connection_handler::~mysql_connection_handler()
 {
-    assert(mc_conn_list.empty());
+    // pool connections are closed here, thread connections by their thread
+    assert(pooled() || mc_conn_list.empty());
 }
 
-sql::Connection* mysql_client::mysql_connection_handler::get_connection()
+// call within mc_guard
+void mysql_client::mysql_connection_handler::connect(conn_entry &e)
 {
+    // prepared statements are rebuilt with the connection
+    if (e.ce_conn && e.ce_conn -> isClosed()) {
+        e.close();
+        mc_stats.local().m_disconnects.add();
+    }
+    
+    // it seems that creating a connection is not thread safe,
+    // so you must call it within a critical section
+    if ( ! e.ce_conn) {
+        e.ce_conn.reset(mc_driver -> connect(mc_host, mc_user, mc_password));
+        e.ce_conn -> setSchema("test");
+        mc_stats.local().m_connects.add();
+    }
+}
+
+void mysql_client::mysql_connection_handler::give_back(conn_entry *e)
+{
+    if ( ! pooled()) return;
+    
     std::lock_guard<std::mutex> lk(mc_guard);
+    mc_pool_free.push_back(e);
+    mc_pool_ready.notify_one();
+}
+
+mysql_client::mysql_connection_handler::lease
+mysql_client::mysql_connection_handler::get_connection()
+{
+    // fast path: the connection of this thread is open
+    if ( ! pooled() && mc_local.le_owner == this
+            && mc_local.le_entry -> ce_conn
+            && ! mc_local.le_entry -> ce_conn -> isClosed()) {
+        return lease(this, mc_local.le_entry);
+    }
+    
+    std::unique_lock<std::mutex> lk(mc_guard);
+    
+    if (pooled()) {
+        mc_pool_ready.wait(lk, [this] {
+            return ! mc_pool_free.empty()
+                || mc_conn_list.size() < mc_pool_size;
+        });
+        
+        conn_entry *e;
+        
+        if (mc_pool_free.empty()) {
+            mc_conn_list.emplace_back(new conn_entry(std::thread::id()));
+            e = mc_conn_list.back().get();
+        } else {
+            e = mc_pool_free.back();
+            mc_pool_free.pop_back();
+        }
+        
+        try {
+            connect(*e);
+        } catch (...) {
+            mc_pool_free.push_back(e);
+            mc_pool_ready.notify_one();
+            throw;
+        }
+        return lease(this, e);
+    }
+    
     auto id = std::this_thread::get_id();
     auto i = find_if(mc_conn_list.begin(), mc_conn_list.end(),
-        [id] (const conn_entry &t) {
-            return id == std::get<0>(t);
+        [id] (const std::unique_ptr<conn_entry> &e) {
+            return id == e -> ce_thread;
         });
     
     if (i == mc_conn_list.end()) {
-        mc_conn_list.emplace_back(id, nullptr);
+        mc_conn_list.emplace_back(new conn_entry(id));
         i = --mc_conn_list.end();
     }
     
-    if (std::get<1>(*i) != nullptr && std::get<1>(*i) -> isClosed()) {
-    	delete std::get<1>(*i);
-    	std::get<1>(*i) = nullptr;
-    }
-    
-    // it seems that creating a connection is not thread safe,
-    // so you must call it within a critical section
-    if (std::get<1>(*i) == nullptr) {
-        std::get<1>(*i) = mc_driver -> connect(mc_host, mc_user, mc_password);
-        std::get<1>(*i) -> setSchema("test");
-    }
-    
-    return std::get<1>(*i);
+    conn_entry &e = **i;
+    connect(e);
+    mc_local.le_owner = this;
+    mc_local.le_entry = &e;
+    return lease(this, &e);
 }
 
 void mysql_client::mysql_connection_handler::close_connection()
 {
+    if (pooled()) return;
+    
     std::lock_guard<std::mutex> lk(mc_guard);
     auto id = std::this_thread::get_id();
     auto i = std::find_if(mc_conn_list.begin(), mc_conn_list.end(),
-        [id] (const conn_entry &t) {
-            return id == std::get<0>(t);
+        [id] (const std::unique_ptr<conn_entry> &e) {
+            return id == e -> ce_thread;
         }
     );
     
     if (i != mc_conn_list.end()) {
-        delete std::get<1>(*i);
+        if ((*i) -> ce_conn) mc_stats.local().m_disconnects.add();
         std::swap(*i, mc_conn_list.back());
         mc_conn_list.pop_back();
     }
+    mc_local.le_owner = nullptr;
+    mc_local.le_entry = nullptr;
 }
 
 mysql_client::mysql_client(const std::string &url, const std::string usr,
-    const std::string &pwd)
-    : mc_conn_handler(new mysql_connection_handler(url, usr, pwd))
+    const std::string &pwd, const mysql_client_options &opt)
+    : mc_conn_handler(new mysql_connection_handler(url, usr, pwd,
+        opt.pool_size)),
+      mc_options(opt)
 {}
 
 mysql_client::~mysql_client()
@@ -126,15 +382,13 @@ mysql_client::~mysql_client()
 
 std::string mysql_client::fetch(const std::string &key)
 {
-    sql::Connection *conn = mc_conn_handler -> get_connection();
+    auto &m = mc_conn_handler -> mc_stats.local();
+    mysql_connection_handler::timed_call t(m.m_fetch, m.m_errors);
+    mysql_connection_handler::lease c = mc_conn_handler -> get_connection();
+    mysql_connection_handler::conn_entry &e = *c;
+    sql::PreparedStatement *pstmt = e.prepare(e.ce_fetch, fetch_query);
     std::string data;
     
-    statement pstmt(conn -> prepareStatement(R"mysql(
-        SELECT     `data`
-        FROM `records`
-        WHERE `key` = ?
-    )mysql"));
-    
     pstmt -> setString(1, key);
     
     result_set res(pstmt -> executeQuery());
@@ -142,54 +396,197 @@ std::string mysql_client::fetch(const std::string &key)
     if (res -> rowsCount() != 0) {
         res -> next();
         data = res -> getString(1);
+        m.m_fetch_rows.add();
     }
     
     return data;
 }
 
-void mysql_client::store(const std::vector<record> &list)
+// a chunk of keys is padded to a power of two, repeating the last key,
+// so that few statements are prepared for each connection
+std::vector<mysql_client::record> mysql_client::fetch_many(
+    const std::vector<std::string> &keys)
+{
+    auto &m = mc_conn_handler -> mc_stats.local();
+    mysql_connection_handler::timed_call t(m.m_fetch, m.m_errors);
+    mysql_connection_handler::lease c = mc_conn_handler -> get_connection();
+    mysql_connection_handler::conn_entry &e = *c;
+    std::vector<record> list;
+    size_t chunk = std::max<size_t>(mc_options.fetch_chunk, 1);
+    
+    for (size_t first = 0; first < keys.size(); first += chunk) {
+        size_t n = std::min(chunk, keys.size() - first);
+        size_t params = 1;
+        while (params < n) params <<= 1;
+        params = std::min(params, chunk);
+        
+        statement &cached = e.ce_fetch_many[params];
+        
+        if ( ! cached) {
+            std::string query = fetch_many_query;
+            for (size_t i = 1; i < params; ++i) query += ",?";
+            query += ")";
+            e.prepare(cached, query);
+        }
+        
+        for (size_t i = 0; i < params; ++i) {
+            cached -> setString(i + 1, keys[first + std::min(i, n - 1)]);
+        }
+        
+        result_set res(cached -> executeQuery());
+        
+        while (res -> next()) {
+            list.emplace_back(res -> getString(1), res -> getString(2));
+        }
+    }
+    
+    m.m_fetch_rows.add(list.size());
+    return list;
+}
+
+std::vector<mysql_client::record> mysql_client::fetch_range(
+    const std::string &from, const std::string &to, size_t limit, bool next)
 {
-    sql::Connection *conn = mc_conn_handler -> get_connection();
+    auto &m = mc_conn_handler -> mc_stats.local();
+    mysql_connection_handler::timed_call t(m.m_fetch, m.m_errors);
+    mysql_connection_handler::lease c = mc_conn_handler -> get_connection();
+    mysql_connection_handler::conn_entry &e = *c;
+    sql::PreparedStatement *pstmt = next
+        ? e.prepare(e.ce_range_next, fetch_range_next)
+        : e.prepare(e.ce_range_first, fetch_range_first);
+    std::vector<record> list;
     
-    conn -> setAutoCommit(false);
+    pstmt -> setString(1, from);
+    pstmt -> setString(2, to);
+    pstmt -> setString(3, to);
+    pstmt -> setUInt(4, std::min<size_t>(limit, UINT32_MAX));
     
-    statement pstmt(conn -> prepareStatement(R"mysql(
-        INSERT INTO `records`
-        SET  `key` = ?, `data` = ?
-        ON DUPLICATE KEY UPDATE `data` = ?
-    )mysql"));
+    result_set res(pstmt -> executeQuery());
     
-    for (auto &t : list) {
-        pstmt -> setString(1, std::get<0>(t));
-        pstmt -> setString(2, std::get<1>(t));
-        pstmt -> setString(3, std::get<1>(t));
-        pstmt -> executeUpdate();
+    while (res -> next()) {
+        list.emplace_back(res -> getString(1), res -> getString(2));
     }
-    conn -> commit();
     
-    conn -> setAutoCommit(true);
+    m.m_fetch_rows.add(list.size());
+    return list;
 }
 
-void mysql_client::store(const std::string &key, const std::string &data)
+// records are grouped in multi-row upserts, bounded by rows and bytes;
+// like fetch_many(), a group is padded to a power of two repeating its
+// last record, which updates the same row twice with the same data
+template<class R>
+void mysql_client::store_records(const std::vector<R> &list)
 {
-    sql::Connection *conn = mc_conn_handler -> get_connection();
+    auto &m = mc_conn_handler -> mc_stats.local();
+    mysql_connection_handler::timed_call t(m.m_store, m.m_errors);
+    mysql_connection_handler::lease c = mc_conn_handler -> get_connection();
+    mysql_connection_handler::conn_entry &e = *c;
+    size_t max_rows = std::max<size_t>(mc_options.store_rows, 1);
     
-    statement pstmt(conn -> prepareStatement(R"mysql(
-        INSERT INTO `records`
-        SET  `key` = ?, `data` = ?
-        ON DUPLICATE KEY UPDATE `data` = ?
-    )mysql"));
+    e.ce_conn -> setAutoCommit(false);
+    
+    try {
+        size_t first = 0;
+        
+        while (first < list.size()) {
+            size_t n = 0, bytes = 0;
+            
+            for (; n < max_rows && first + n < list.size(); ++n) {
+                const R &t = list[first + n];
+                size_t size = std::get<0>(t).size() + data_of(t).size();
+                if (n != 0 && bytes + size > mc_options.store_bytes) break;
+                bytes += size;
+            }
+            
+            size_t rows = 1;
+            while (rows < n) rows <<= 1;
+            rows = std::min(rows, max_rows);
+            
+            // padding must not exceed the payload bound,
+            // otherwise the statement is not cached
+            const R &last = list[first + n - 1];
+            size_t pad = std::get<0>(last).size() + data_of(last).size();
+            statement uncached;
+            statement *pstmt = &uncached;
+            
+            if (rows == n
+                    || bytes + (rows - n) * pad <= mc_options.store_bytes) {
+                pstmt = &e.ce_store_many[rows];
+            } else rows = n;
+            
+            if ( ! *pstmt) {
+                std::string query = store_many_query;
+                for (size_t i = 1; i < rows; ++i) query += ",(?, ?)";
+                query += store_many_update;
+                e.prepare(*pstmt, query);
+            }
+            
+            // a stream is read once, padding rows get their own
+            std::vector<std::unique_ptr<data_stream>> streams;
+            
+            for (size_t i = 0; i < rows; ++i) {
+                const R &t = list[first + std::min(i, n - 1)];
+                const std::string &data = data_of(t);
+                (*pstmt) -> setString(2 * i + 1, std::get<0>(t));
+                
+                if (data.size() >= mc_options.stream_bytes) {
+                    streams.emplace_back(new data_stream(data));
+                    (*pstmt) -> setBlob(2 * i + 2, streams.back().get());
+                } else (*pstmt) -> setString(2 * i + 2, data);
+            }
+            (*pstmt) -> executeUpdate();
+            first += n;
+        }
+        e.ce_conn -> commit();
+        
+    } catch (...) {
+        // the first error is the one reported, a broken connection
+        // fails the rollback too
+        try {
+            e.ce_conn -> rollback();
+        } catch (...) {
+        }
+        try {
+            e.ce_conn -> setAutoCommit(true);
+        } catch (...) {
+        }
+        throw;
+    }
+    
+    e.ce_conn -> setAutoCommit(true);
+    m.m_store_rows.add(list.size());
+}
+
+void mysql_client::store(const std::vector<record> &list)
+{
+    store_records(list);
+}
+
+void mysql_client::store(const std::vector<shared_record> &list)
+{
+    store_records(list);
+}
+
+void mysql_client::store(const std::string &key, const std::string &data)
+{
+    auto &m = mc_conn_handler -> mc_stats.local();
+    mysql_connection_handler::timed_call t(m.m_store, m.m_errors);
+    mysql_connection_handler::lease c = mc_conn_handler -> get_connection();
+    mysql_connection_handler::conn_entry &e = *c;
+    sql::PreparedStatement *pstmt = e.prepare(e.ce_store, store_query);
     
     pstmt -> setString(1, key);
     pstmt -> setString(2, data);
     pstmt -> setString(3, data);
     pstmt -> executeUpdate();
+    m.m_store_rows.add();
 }
 
+// in pool mode connections are opened on demand
 void mysql_client::thread_init()
 {
     ::mysql_thread_init();
-    mc_conn_handler -> get_connection();
+    if ( ! mc_conn_handler -> pooled()) mc_conn_handler -> get_connection();
 }
 
 void mysql_client::thread_end()
@@ -197,3 +594,20 @@ void mysql_client::thread_end()
     mc_conn_handler -> close_connection();
     ::mysql_thread_end();
 }
+
+mysql_client_stats mysql_client::stats() const
+{
+    mysql_client_stats st;
+    
+    mc_conn_handler -> mc_stats.for_each(
+        [&st] (const mysql_connection_handler::counters &m) {
+            m.m_fetch.read(st.fetch);
+            st.fetch_rows += m.m_fetch_rows.get();
+            m.m_store.read(st.store);
+            st.store_rows += m.m_store_rows.get();
+            st.errors += m.m_errors.get();
+            st.connects += m.m_connects.get();
+            st.disconnects += m.m_disconnects.get();
+        });
+    return st;
+}
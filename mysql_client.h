@@ -29,6 +29,39 @@ THE SOFTWARE.
 #include <string>
 #include <tuple>
 #include <vector>
+#include "db_backend.h"
+#include "metrics.h"
+
+// client parameters
+struct mysql_client_options
+{
+    size_t fetch_chunk; // keys in a single query of fetch_many()
+    size_t store_rows; // records in a single statement of store(list)
+    size_t store_bytes; // payload of a single statement of store(list)
+    size_t pool_size; // connections shared by all threads, 0 for one each
+    size_t stream_bytes; // data streamed by store(list), not copied
+    
+    mysql_client_options() :
+        fetch_chunk(100), store_rows(500), store_bytes(1 << 20), pool_size(0),
+        stream_bytes(1 << 16)
+    {}
+};
+
+// counters since the client was created, see mysql_client::stats()
+struct mysql_client_stats
+{
+    latency_stats fetch; // fetch(), fetch_many() and fetch_range() calls
+    uint64_t fetch_rows;
+    latency_stats store; // store() calls
+    uint64_t store_rows;
+    uint64_t errors; // calls which threw
+    uint64_t connects; // connections opened, again after a drop too
+    uint64_t disconnects; // connections closed or found dropped
+    
+    mysql_client_stats() :
+        fetch_rows(0), store_rows(0), errors(0), connects(0), disconnects(0)
+    {}
+};
 
 /*!
     \brief Client for mysql table.
@@ -43,7 +76,13 @@ THE SOFTWARE.
     
     If key is not in table, insert a new entry with empty data.
     
-    This class handles a single connection for each thread.
+    This class handles a single connection for each thread; an open
+    connection is found without locking. Statements are prepared once for
+    each connection and reused until the connection is closed.
+    
+    In pool mode (mysql_client_options::pool_size != 0) threads do not own
+    a connection, each operation borrows one of pool_size connections and
+    waits if all of them are busy.
     Only one instance of this class is allowed in a process.
     Since mysql requires to call mysql_thread_end() before thread ends,
     you must call the following methods within the thread:
@@ -53,27 +92,63 @@ THE SOFTWARE.
     
     this is true for the main thread too.
 */
-class mysql_client
+class mysql_client : public db_backend
 {
     class mysql_connection_handler;
     
     std::unique_ptr<mysql_connection_handler> mc_conn_handler;
+    const mysql_client_options mc_options;
     
-public:
+    template<class R> void store_records(const std::vector<R> &list);
     
-    // key, data
-    typedef std::tuple<std::string, std::string> record;
+public:
     
     mysql_client(const std::string &url, const std::string usr,
-        const std::string &pwd);
+        const std::string &pwd,
+        const mysql_client_options &opt = mysql_client_options());
         
     ~mysql_client();
     
-    std::string fetch(const std::string &key);
-    void store(const std::string &key, const std::string &data);
-    void store(const std::vector<record> &list);
-    void thread_init();
-    void thread_end();
+    std::string fetch(const std::string &key) override;
+    
+    /*!
+        \brief Fetch many keys with IN-list queries.
+        
+        Keys are sent in chunks of mysql_client_options::fetch_chunk.
+        
+        \return the records found, in any order.
+    */
+    std::vector<record> fetch_many(const std::vector<std::string> &keys)
+        override;
+    
+    /*!
+        \brief Fetch a page of records in key order.
+        
+        \param from first key of the page.
+        \param to end of the range, not included; empty for no end.
+        \param limit most records in the page.
+        \param next from is the last key of the previous page, not included.
+        \return the records sorted by key.
+    */
+    std::vector<record> fetch_range(const std::string &from,
+        const std::string &to, size_t limit, bool next = false) override;
+    void store(const std::string &key, const std::string &data) override;
+    
+    /*!
+        \brief Store many records in a transaction.
+        
+        Records are sent with multi-row upserts of up to
+        mysql_client_options::store_rows records and store_bytes bytes.
+        Data of stream_bytes or more is sent to the server from the record
+        in chunks, without a copy in a statement parameter.
+    */
+    void store(const std::vector<record> &list) override;
+    void store(const std::vector<shared_record> &list) override;
+    void thread_init() override;
+    void thread_end() override;
+    
+    //! Read the counters, summed over the threads, see metrics.h.
+    mysql_client_stats stats() const;
 };
 
 #endif
\ No newline at end of file
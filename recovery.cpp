@@ -0,0 +1,367 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Fabio Vaccari
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// crash recovery checks over an in-memory backend: the write-ahead log
+// replay, a failed log commit, a failed store and the snapshot round trip;
+// a crash is a child process which ends with _exit()
+
+#include "db_cache.h"
+#include "memory_backend.h"
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+std::string dir; // of the files, removed at the end
+
+std::string key_of(size_t n)
+{
+    return "k" + std::to_string(n);
+}
+
+// files of the directory which start with prefix
+size_t count_files(const std::string &prefix)
+{
+    size_t count = 0;
+    
+    if (DIR *d = ::opendir(dir.c_str())) {
+        while (dirent *e = ::readdir(d)) {
+            if (std::string(e -> d_name).compare(0, prefix.size(), prefix)
+                == 0) ++count;
+        }
+        ::closedir(d);
+    }
+    return count;
+}
+
+bool exists(const std::string &path)
+{
+    return ::access(path.c_str(), F_OK) == 0;
+}
+
+// waits up to a second for the backend to hold data for key
+bool wait_stored(memory_backend &backend, const std::string &key,
+    const std::string &data)
+{
+    for (int n = 0; n < 100; ++n) {
+        if (backend.fetch(key) == data) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+// a backend whose stores fail on demand; with hold set, the next store
+// waits for release() before failing
+class failing_backend : public memory_backend
+{
+    std::mutex fb_guard;
+    std::condition_variable fb_released;
+    bool fb_hold;
+    bool fb_holding;
+    
+public:
+    std::atomic<bool> fail;
+    
+    failing_backend() :
+        fb_hold(false), fb_holding(false), fail(false), rows(0)
+    {}
+    
+    void hold()
+    {
+        std::lock_guard<std::mutex> lk(fb_guard);
+        fb_hold = true;
+    }
+    
+    // true once a store waits
+    bool holding()
+    {
+        std::lock_guard<std::mutex> lk(fb_guard);
+        return fb_holding;
+    }
+    
+    void release()
+    {
+        std::lock_guard<std::mutex> lk(fb_guard);
+        fb_hold = false;
+        fb_released.notify_all();
+    }
+    
+    using memory_backend::store;
+    
+    std::atomic<size_t> rows; // stored
+    
+    void store(const std::vector<shared_record> &list) override
+    {
+        std::unique_lock<std::mutex> lk(fb_guard);
+        
+        if (fb_hold) {
+            fb_holding = true;
+            fb_released.wait(lk, [this] { return ! fb_hold; });
+            lk.unlock();
+            throw std::runtime_error("store failed");
+        }
+        lk.unlock();
+        
+        if (fail) throw std::runtime_error("store failed");
+        memory_backend::store(list);
+        rows += list.size();
+    }
+};
+
+// waits up to a second for a condition
+template <typename F>
+bool wait_for(F f)
+{
+    for (int n = 0; n < 100; ++n) {
+        if (f()) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+// runs f in a child process, true if it returns true
+template <typename F>
+bool in_child(F f)
+{
+    std::cout.flush();
+    pid_t pid = ::fork();
+    if (pid == 0) ::_exit(f() ? 0 : 1);
+    
+    int status = 0;
+    if (pid < 0 || ::waitpid(pid, &status, 0) != pid) return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// the child modifies every key and crashes before any database update;
+// the next cache stores the data before it starts
+bool log_replay()
+{
+    const size_t keys = 200, threads = 4, rounds = 50;
+    std::string wal = dir + "/replay";
+    
+    bool crashed = in_child([&] {
+        memory_backend backend;
+        db_cache_options opt;
+        opt.update_time = 3600000;
+        opt.wal = wal;
+        db_cache *cache = new db_cache(&backend, opt);
+        std::vector<std::thread> vt;
+        
+        for (size_t t = 0; t < threads; ++t) {
+            vt.emplace_back([&, t] {
+                for (size_t r = 0; r < rounds; ++r) {
+                    for (size_t n = t; n < keys; n += threads) {
+                        data_handle dh = (*cache)[key_of(n)];
+                        dh.modify() = std::to_string(r);
+                    }
+                }
+            });
+        }
+        for (auto &t : vt) t.join();
+        
+        // no destructor, nothing is stored
+        return backend.store_calls() == 0;
+    });
+    if ( ! crashed) return false;
+    
+    memory_backend backend;
+    {
+        db_cache_options opt;
+        opt.wal = wal;
+        db_cache cache(&backend, opt);
+    }
+    
+    for (size_t n = 0; n < keys; ++n) {
+        if (backend.fetch(key_of(n)) != std::to_string(rounds - 1)) {
+            return false;
+        }
+    }
+    return count_files("replay.") == 0;
+}
+
+// the log cannot grow for a while: the write is not stored until its
+// record is on disk, then both complete
+bool failed_commit()
+{
+    std::string wal = dir + "/failed";
+    
+    return in_child([&] {
+        std::signal(SIGXFSZ, SIG_IGN);
+        memory_backend backend;
+        db_cache_options opt;
+        opt.update_time = 10;
+        opt.wal = wal;
+        db_cache cache(&backend, opt);
+        
+        cache["a"].modify() = "1";
+        if ( ! wait_stored(backend, "a", "1")) return false;
+        
+        rlimit limit;
+        ::getrlimit(RLIMIT_FSIZE, &limit);
+        rlimit small = limit;
+        small.rlim_cur = 1;
+        ::setrlimit(RLIMIT_FSIZE, &small);
+        
+        cache["a"].modify() = "2";
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        bool held = backend.fetch("a") == "1"
+            && cache.stats().wal.failures != 0;
+        
+        ::setrlimit(RLIMIT_FSIZE, &limit);
+        return held && wait_stored(backend, "a", "2");
+    });
+}
+
+// a store fails while a newer version of the key waits for the writer:
+// that version stores the data once, and the clean entry is neither
+// queued again nor handed to a writer, where eviction would free it
+bool failed_store()
+{
+    failing_backend backend;
+    db_cache_options opt;
+    opt.update_time = 5;
+    opt.max_size = 20;
+    opt.shards = 1;
+    db_cache cache(&backend, opt);
+    
+    backend.hold();
+    cache["a"].modify() = "1";
+    if ( ! wait_for([&] { return backend.holding(); })) return false;
+    
+    // taken by the next update while the writer is stuck
+    cache["a"].modify() = "2";
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    backend.release();
+    if ( ! wait_stored(backend, "a", "2")) return false;
+    
+    // evictions around the entry, then updates with nothing to store
+    for (size_t n = 0; n < 200; ++n) {
+        cache.get_shared(key_of(n));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    return backend.rows == 1 && *cache.get_shared("a") == "2";
+}
+
+// the entries come back without database reads, modified ones too;
+// a store after an explicit snapshot removes the file, a store which
+// fails at the close keeps it for the next cache
+bool snapshot_round_trip()
+{
+    const size_t keys = 100;
+    std::string file = dir + "/snapshot";
+    failing_backend backend;
+    std::vector<db_backend::record> rows;
+    
+    for (size_t n = 0; n < keys; ++n) rows.emplace_back(key_of(n), "v");
+    backend.store(rows);
+    
+    db_cache_options opt;
+    opt.update_time = 10;
+    opt.close_retries = 1;
+    opt.snapshot = file;
+    
+    {
+        db_cache cache(&backend, opt);
+        for (size_t n = 0; n < keys; ++n) {
+            data_handle dh = cache[key_of(n)];
+            if (n % 10 == 0) dh.modify() = "m";
+        }
+    }
+    if ( ! exists(file)) return false;
+    
+    {
+        db_cache cache(&backend, opt);
+        uint64_t fetches = backend.fetch_calls();
+        
+        for (size_t n = 0; n < keys; ++n) {
+            if (*cache.get_shared(key_of(n)) != (n % 10 == 0 ? "m" : "v")) {
+                return false;
+            }
+        }
+        if (backend.fetch_calls() != fetches || exists(file)) return false;
+        
+        cache.snapshot();
+        if ( ! exists(file)) return false;
+        
+        cache["k1"].modify() = "newer";
+        if ( ! wait_stored(backend, "k1", "newer") || exists(file)) {
+            return false;
+        }
+        
+        backend.fail = true;
+        cache["k2"].modify() = "failed";
+    }
+    if ( ! exists(file) || backend.fetch("k2") != "v") return false;
+    
+    backend.fail = false;
+    db_cache cache(&backend, opt);
+    if ( ! wait_stored(backend, "k2", "failed")) return false;
+    return wait_for([&] { return ! exists(file); });
+}
+
+}
+
+int main()
+{
+    char path[] = "/tmp/db_cache_recovery.XXXXXX";
+    if (::mkdtemp(path) == nullptr) {
+        std::perror("mkdtemp");
+        return 2;
+    }
+    dir = path;
+    
+    struct check
+    {
+        const char *name;
+        bool (*run)();
+    };
+    const check checks[] = {
+        { "log replay", log_replay },
+        { "failed commit", failed_commit },
+        { "failed store", failed_store },
+        { "snapshot round trip", snapshot_round_trip }
+    };
+    int failed = 0;
+    
+    for (const check &c : checks) {
+        bool ok = c.run();
+        std::cout << c.name << ": " << (ok ? "ok" : "FAILED") << std::endl;
+        if ( ! ok) ++failed;
+    }
+    
+    std::system(("rm -rf " + dir).c_str());
+    return failed;
+}
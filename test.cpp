@@ -77,6 +77,33 @@ std::vector<mysql_client::record> random_table()
     return list;
 }
 
+static
+void print_latency(const char *name, const latency_stats &l)
+{
+    std::cout << name << ": " << l.count << ", mean "
+              << uint64_t(l.mean_ns()) / 1000 << " us, p99 < "
+              << l.percentile_ns(99) / 1000 << " us\n";
+}
+
+static
+void print_stats(const db_cache_stats &st)
+{
+    std::cout
+        << "hits: " << st.hits << ", misses: " << st.misses << '\n'
+        << "lock waits: " << st.lock_waits
+        << ", timeouts: " << st.lock_timeouts << '\n'
+        << "evictions: " << st.evictions << '\n'
+        << "cold entries: " << st.cold_entries
+        << ", bytes: " << st.cold_bytes
+        << ", hits: " << st.cold_hits << '\n'
+        << "flushes: " << st.flushes << ", rows: " << st.flush_rows
+        << ", bytes: " << st.flush_bytes << '\n';
+    print_latency("lock wait", st.lock_wait);
+    print_latency("flush", st.flush_time);
+    print_latency("container lock wait", st.shard_wait);
+    print_latency("container lock hold", st.shard_hold);
+}
+
 // start different threads
 // each of them fetches a list of records and compares values
 // if the values don't correspond, store the value on the list
@@ -97,7 +124,9 @@ void test_cached(mysql_client &client)
                 for (;;) try {
                     auto h = cclient[std::get<0>(t)];
                     
-                    if (*h != std::get<1>(t)) { *h = std::get<1>(t); }
+                    if (h.value() != std::get<1>(t)) {
+                        h.modify() = std::get<1>(t);
+                    }
                     break;
                     
                 } catch(db_cache_timeout e) {
@@ -123,6 +152,8 @@ void test_cached(mysql_client &client)
         });
     }
     for (auto &t : vt) t.join();
+    
+    print_stats(cclient.stats());
 }
 
 int main()
@@ -156,6 +187,11 @@ int main()
         << duration_cast<milliseconds>(t1 - t0).count()
         << " milliseconds.\n" << std::endl;
     
+    mysql_client_stats st = client.stats();
+    print_latency("database fetch", st.fetch);
+    print_latency("database store", st.store);
+    std::cout << "connections: " << st.connects << '\n' << std::endl;
+    
     return 0;
 }
 
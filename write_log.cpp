@@ -0,0 +1,366 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Fabio Vaccari
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "write_log.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <unordered_map>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace {
+
+// record: key size, data size (32 bits each), key, data, then the crc32
+// of all of them; numbers in host byte order, like the snapshot file
+
+template <typename T>
+void put(std::string &out, T value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+bool get(const char *&p, const char *end, T &value)
+{
+    if (size_t(end - p) < sizeof(value)) return false;
+    std::memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+}
+
+uint32_t checksum(const char *p, size_t size)
+{
+    return ::crc32(0, reinterpret_cast<const Bytef*>(p), size);
+}
+
+bool write_all(int fd, const std::string &data)
+{
+    const char *p = data.data();
+    size_t left = data.size();
+    
+    while (left != 0) {
+        ssize_t n = ::write(fd, p, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        left -= n;
+    }
+    return true;
+}
+
+// a new file is durable once its directory is synced
+void sync_directory(const std::string &path)
+{
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "."
+        : slash == 0 ? "/" : path.substr(0, slash);
+    
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    ::fsync(fd);
+    ::close(fd);
+}
+
+}
+
+// segments on disk are found by name, path.N with any N
+write_log::write_log(const std::string &path) :
+    wl_path(path), wl_fd(-1), wl_first(1), wl_segment(1), wl_size(0),
+    wl_appended(0), wl_durable(0), wl_committing(false), wl_torn(false),
+    wl_records(0),
+    wl_commits(0), wl_failures(0)
+{
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "."
+        : slash == 0 ? "/" : path.substr(0, slash);
+    std::string prefix = path.substr(slash + 1) + ".";
+    
+    if (DIR *d = ::opendir(dir.c_str())) {
+        while (dirent *e = ::readdir(d)) {
+            std::string name = e -> d_name;
+            
+            if (name.size() > prefix.size()
+                && name.compare(0, prefix.size(), prefix) == 0
+                && name.find_first_not_of("0123456789", prefix.size())
+                    == std::string::npos) {
+                wl_recovered.push_back(std::stoull(name.substr(prefix.size())));
+            }
+        }
+        ::closedir(d);
+    }
+    std::sort(wl_recovered.begin(), wl_recovered.end());
+    
+    if ( ! wl_recovered.empty()) {
+        wl_first = wl_recovered.front();
+        wl_segment = wl_recovered.back() + 1;
+    }
+    
+    // found segments are needed until clear(), gaps are deleted by trim()
+    wl_live.assign(wl_segment - wl_first, 0);
+    for (uint64_t s : wl_recovered) wl_live[s - wl_first] = 1;
+    wl_live.push_back(0);
+    
+    wl_fd = create(wl_segment);
+    if (wl_fd < 0) {
+        throw std::runtime_error("Log: cannot create "
+            + segment_name(wl_segment));
+    }
+}
+
+write_log::~write_log()
+{
+    std::unique_lock<std::mutex> lk(wl_guard);
+    if ( ! wl_buffer.empty()) commit(lk);
+    ::close(wl_fd);
+    
+    // the last segment too, if nothing is needed any more
+    trim();
+    if (wl_first == wl_segment && wl_live.front() == 0) {
+        ::unlink(segment_name(wl_segment).c_str());
+    }
+}
+
+std::string write_log::segment_name(uint64_t segment) const
+{
+    return wl_path + "." + std::to_string(segment);
+}
+
+int write_log::create(uint64_t segment)
+{
+    int fd = ::open(segment_name(segment).c_str(),
+        O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd >= 0) sync_directory(wl_path);
+    return fd;
+}
+
+// a damaged record ends its segment: the tail of a crashed commit
+std::vector<db_backend::record> write_log::recover()
+{
+    std::unordered_map<std::string, std::string> latest;
+    
+    for (uint64_t segment : wl_recovered) {
+        std::ifstream in(segment_name(segment), std::ios::binary);
+        std::string file((std::istreambuf_iterator<char>(in)),
+            std::istreambuf_iterator<char>());
+        const char *p = file.data();
+        const char *end = p + file.size();
+        
+        for (;;) {
+            const char *record = p;
+            uint32_t key_size, data_size, crc;
+            
+            if ( ! get(p, end, key_size) || ! get(p, end, data_size)
+                || size_t(end - p) < uint64_t(key_size) + data_size) break;
+            
+            const char *key = p;
+            p += key_size + data_size;
+            
+            if ( ! get(p, end, crc)
+                || crc != checksum(record, p - sizeof(crc) - record)) break;
+            
+            latest[std::string(key, key_size)]
+                .assign(key + key_size, data_size);
+        }
+    }
+    
+    std::vector<db_backend::record> list;
+    list.reserve(latest.size());
+    for (auto &l : latest) list.emplace_back(l.first, std::move(l.second));
+    return list;
+}
+
+void write_log::clear()
+{
+    std::lock_guard<std::mutex> lk(wl_guard);
+    for (uint64_t s : wl_recovered) wl_live[s - wl_first] = 0;
+    wl_recovered.clear();
+    trim();
+}
+
+uint64_t write_log::append(const std::string &key, const std::string &data,
+    log_ref &ref, unsigned long version)
+{
+    std::lock_guard<std::mutex> lk(wl_guard);
+    size_t start = wl_buffer.size();
+    
+    put<uint32_t>(wl_buffer, key.size());
+    put<uint32_t>(wl_buffer, data.size());
+    wl_buffer.append(key);
+    wl_buffer.append(data);
+    put<uint32_t>(wl_buffer,
+        checksum(wl_buffer.data() + start, wl_buffer.size() - start));
+    
+    // the replaced record is needed until this one is on disk
+    if (ref.lr_segment != 0) {
+        wl_superseded.emplace_back(wl_appended + 1, ref.lr_segment);
+    }
+    ++wl_live.back();
+    ref.lr_segment = wl_segment;
+    ref.lr_version = version;
+    trim();
+    
+    ++wl_records;
+    return ++wl_appended;
+}
+
+// the first waiter commits the whole buffer, the others wait for it
+void write_log::wait(uint64_t record)
+{
+    std::unique_lock<std::mutex> lk(wl_guard);
+    
+    while (wl_durable < record) {
+        bool ok;
+        
+        if (wl_committing) {
+            uint64_t failures = wl_failures;
+            wl_committed.wait(lk, [this] { return ! wl_committing; });
+            ok = wl_failures == failures;
+        } else ok = commit(lk);
+        
+        if ( ! ok && wl_durable < record) {
+            throw std::runtime_error("Log: cannot write "
+                + segment_name(wl_segment));
+        }
+    }
+}
+
+void write_log::sync()
+{
+    std::unique_lock<std::mutex> lk(wl_guard);
+    uint64_t record = wl_appended;
+    lk.unlock();
+    wait(record);
+}
+
+// call with the lock held and no commit running; appends go on meanwhile
+bool write_log::commit(std::unique_lock<std::mutex> &lk)
+{
+    std::string batch;
+    batch.swap(wl_buffer);
+    uint64_t last = wl_appended;
+    uint64_t size = wl_size;
+    bool torn = wl_torn;
+    wl_committing = true;
+    lk.unlock();
+    
+    // a torn batch would hide the records written after it, and after
+    // a failed sync only pages written again are sure to reach the disk
+    auto start = std::chrono::steady_clock::now();
+    bool ok = ( ! torn || ::ftruncate(wl_fd, size) == 0)
+        && write_all(wl_fd, batch) && ::fdatasync(wl_fd) == 0;
+    
+    lk.lock();
+    wl_committing = false;
+    wl_torn = ! ok;
+    
+    if (ok) {
+        wl_size += batch.size();
+        wl_durable = last;
+        ++wl_commits;
+        wl_commit_time.add_since(start);
+        
+        while ( ! wl_superseded.empty()
+                && wl_superseded.front().first <= last) {
+            release(wl_superseded.front().second);
+            wl_superseded.pop_front();
+        }
+        trim();
+    } else {
+        batch.append(wl_buffer);
+        wl_buffer.swap(batch);
+        ++wl_failures;
+    }
+    
+    wl_committed.notify_all();
+    return ok;
+}
+
+void write_log::stored(log_ref &ref, unsigned long version)
+{
+    std::lock_guard<std::mutex> lk(wl_guard);
+    
+    if (ref.lr_segment != 0 && version >= ref.lr_version) {
+        release(ref.lr_segment);
+        ref.lr_segment = 0;
+        trim();
+    }
+}
+
+// if the buffer or the new segment cannot be written, the current
+// segment goes on
+void write_log::rotate()
+{
+    std::unique_lock<std::mutex> lk(wl_guard);
+    
+    while (wl_committing || ! wl_buffer.empty()) {
+        if (wl_committing) wl_committed.wait(lk);
+        else if ( ! commit(lk)) return;
+    }
+    if (wl_size == 0) return;
+    
+    int fd = create(wl_segment + 1);
+    if (fd < 0) return;
+    
+    ::close(wl_fd);
+    wl_fd = fd;
+    wl_size = 0;
+    ++wl_segment;
+    wl_live.push_back(0);
+    trim();
+}
+
+void write_log::release(uint64_t segment)
+{
+    --wl_live[segment - wl_first];
+}
+
+// segments are deleted in order, the one being written is kept
+void write_log::trim()
+{
+    while (wl_first < wl_segment && wl_live.front() == 0) {
+        ::unlink(segment_name(wl_first).c_str());
+        wl_live.pop_front();
+        ++wl_first;
+    }
+}
+
+write_log_stats write_log::stats()
+{
+    write_log_stats st;
+    std::lock_guard<std::mutex> lk(wl_guard);
+    
+    st.records = wl_records;
+    st.commits = wl_commits;
+    st.failures = wl_failures;
+    wl_commit_time.read(st.commit_time);
+    st.segments = wl_segment - wl_first + 1;
+    return st;
+}
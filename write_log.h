@@ -0,0 +1,170 @@
+#ifndef WRITE_LOG_H
+#define WRITE_LOG_H
+
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Fabio Vaccari
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "db_backend.h"
+#include "metrics.h"
+
+// an entry's last record in the log, guarded by the log
+struct log_ref
+{
+    uint64_t lr_segment; // 0 for none
+    unsigned long lr_version;
+    
+    log_ref() : lr_segment(0), lr_version(0) {}
+};
+
+// counters since the log was opened, see write_log::stats()
+struct write_log_stats
+{
+    uint64_t records; // appended
+    uint64_t commits; // writes to disk, one fsync each
+    uint64_t failures; // commits which failed, written again later
+    latency_stats commit_time;
+    size_t segments; // files on disk
+    
+    write_log_stats() : records(0), commits(0), failures(0), segments(0) {}
+};
+
+/*!
+    \brief Append-only log of the modified data, for crash recovery.
+    
+    The log is a sequence of segment files, path.1, path.2 and so on.
+    A record holds a key and its data, with a checksum. Records are
+    appended to a buffer; a thread waiting for its record writes the whole
+    buffer and syncs the file once for all the waiting threads (group
+    commit), the others wait for it.
+    
+    Each entry references its last record; a record is needed until its
+    data is in the database or the entry has a newer one on disk. A
+    segment with no record needed is deleted, oldest first, once it is
+    not the one being written; rotate() starts a new segment.
+    
+    A failed commit leaves its records in the buffer, the file is cut
+    back before they are written again. The data of a record must not
+    reach the database before the record is on disk, see sync(): replay
+    would store an older record of the key after it.
+    
+    Segments found when the log is opened are read by recover() and kept
+    until clear().
+*/
+class write_log
+{
+    const std::string wl_path;
+    std::mutex wl_guard;
+    std::condition_variable wl_committed;
+    int wl_fd; // of the segment being written
+    uint64_t wl_first; // oldest segment on disk
+    uint64_t wl_segment; // segment being written
+    std::deque<size_t> wl_live; // records needed, by segment from wl_first
+    uint64_t wl_size; // of the segment being written, on disk
+    std::string wl_buffer; // records not written yet
+    uint64_t wl_appended; // number of the last record appended
+    uint64_t wl_durable; // number of the last record committed
+    bool wl_committing;
+    bool wl_torn; // the last commit failed, the file may have a tail
+    std::deque<std::pair<uint64_t, uint64_t>> wl_superseded; // record,
+                        // segment of the one it replaces, until on disk
+    std::vector<uint64_t> wl_recovered; // segments found on open
+    
+    uint64_t wl_records, wl_commits, wl_failures;
+    stat_latency wl_commit_time;
+    
+    std::string segment_name(uint64_t segment) const;
+    int create(uint64_t segment);
+    bool commit(std::unique_lock<std::mutex> &lk);
+    void release(uint64_t segment);
+    void trim();
+    
+public:
+    
+    /*!
+        \brief Open the log, segments on disk are kept for recover().
+        
+        \throw std::runtime_error if a segment cannot be created.
+    */
+    explicit write_log(const std::string &path);
+    
+    // segments are deleted if no record is needed
+    ~write_log();
+    
+    write_log(const write_log&) = delete;
+    write_log& operator = (const write_log&) = delete;
+    
+    //! The last data of each key in the segments found on open.
+    std::vector<db_backend::record> recover();
+    
+    //! Delete the segments found on open, once their data is stored.
+    void clear();
+    
+    /*!
+        \brief Append a record, it replaces the last one of the entry.
+        
+        Call with the entry locked exclusively, so that the records of
+        a key are in order.
+        
+        \param ref the reference of the entry to its last record.
+        \param version of the entry with this data.
+        \return the number of the record, see wait().
+    */
+    uint64_t append(const std::string &key, const std::string &data,
+        log_ref &ref, unsigned long version);
+    
+    /*!
+        \brief Wait until a record is on disk.
+        
+        \throw std::runtime_error if the commit of the record failed; it
+        is counted in stats() and the record is written by the next one.
+    */
+    void wait(uint64_t record);
+    
+    /*!
+        \brief Wait until all the records appended so far are on disk.
+        
+        Call before their data is stored to the database.
+        
+        \throw std::runtime_error as wait().
+    */
+    void sync();
+    
+    //! The entry's data of version is in the database.
+    void stored(log_ref &ref, unsigned long version);
+    
+    //! Commit the buffer and start a new segment.
+    void rotate();
+    
+    write_log_stats stats();
+};
+
+#endif